@@ -0,0 +1,426 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Training benchmark: sweeps MLP shapes, batch sizes and thread counts over Topo and TopoMT(gather and scatter backward) executors.
+// Data is random and generated locally. Results are printed as CSV(default) or JSON(--json).
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/random.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "std.h"
+#include "value.h"
+#include "param.h"
+#include "topo.h"
+#include "cost.h"
+#include "trace.h"
+#include "topo_mt.h"
+#include "optim.h"
+#include "perf.h"
+#include "mlp.h"
+
+typedef struct BenchResult_s
+{
+	const char *executor;
+	int width; // neurons per hidden layer
+	int depth; // # of hidden layers
+	int batch; // samples per graph
+	int threads;
+
+	int num_nodes;
+	int num_params;
+	double build_s;	  // graph + Topo
+	double fwd_nps;	  // forward nodes per second
+	double bwd_nps;	  // backward nodes per second
+	double update_s;  // one optimizer step
+	long peak_rss_kb; // peak of child process which ran only this configuration
+	char failed;	  // child process died, other results are 0
+
+	char has_perf;
+	long long perf[PerfPhase_NUM][Perf_NUM]; // -1 = not available
+} BenchResult;
+
+long Bench_peakRss(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss; // KB on Linux
+}
+
+BenchResult _Bench_config(const int width, const int depth, const int batch, const int threads, const TopoMT_BACKWARD backward)
+{
+	BenchResult r;
+	memset(&r, 0, sizeof(BenchResult));
+	r.executor = threads ? (backward == TopoMT_BACKWARD_SCATTER ? "topo_mt_scatter" : "topo_mt") : "topo";
+	r.width = width;
+	r.depth = depth;
+	r.batch = batch;
+	r.threads = threads ? threads : 1;
+	return r;
+}
+
+// runs one configuration, 'threads' = 0 means single thread Topo_run executor. 'backward' is used by TopoMT only
+BenchResult Bench_run(const int width, const int depth, const int batch, const int threads, const TopoMT_BACKWARD backward, const int iters, const char has_perf, const char pin)
+{
+	BenchResult r = _Bench_config(width, depth, batch, threads, backward);
+
+	const int num_inputs = width;
+	int sizes[depth + 1];
+	for (int i = 0; i < depth; i++)
+		sizes[i] = width;
+	sizes[depth] = 1;
+
+	ValueAllocator *va = ValueAllocator_new();
+	MLP *mlp = MLP_new(num_inputs, sizes, depth + 1);
+	Optim *optim = Optim_newAdam(mlp->params, 0.001, 0.9, 0.999, 1e-8, 0);
+	r.num_params = mlp->params->num_values;
+
+	// synthetic samples
+	Value **x = malloc(batch * num_inputs * sizeof(Value *));
+	Value **pws = malloc(batch * sizeof(Value *));
+	for (int i = 0; i < batch * num_inputs; i++)
+		x[i] = VA_const(va, Std_random11());
+
+	double st = Os_time();
+	for (int j = 0; j < batch; j++)
+	{
+		Value *ypred = MLP_build(mlp, &x[j * num_inputs], va)[0];
+		pws[j] = VA_powConst(va, VA_sub(va, ypred, VA_const(va, Std_random11())), VA_const(va, 2));
+	}
+	Value *loss = VA_sum(va, pws, batch);
+	Topo *topo = Topo_new(loss);
+	r.build_s = Os_time() - st;
+	r.num_nodes = Topo_numParameters(topo);
+
+	Perf *perf = has_perf ? Perf_new() : 0; // before TopoMT, so workers inherit counters
+	TopoMT *mt = threads ? TopoMT_new(threads) : 0;
+	if (mt && pin)
+		TopoMT_setPinning(mt, 1);
+	if (mt)
+		TopoMT_setBackward(mt, backward);
+
+	// warm up, builds users for gather
+	if (mt)
+		TopoMT_run(mt, topo);
+	else
+		Topo_run(topo);
+
+	double fwd = 0, bwd = 0, upd = 0;
+	for (int k = 0; k < iters; k++)
+	{
+		st = Os_time();
+		if (perf)
+			Perf_begin(perf);
+		if (mt)
+			TopoMT_forward(mt, topo);
+		else
+			Topo_forward(topo);
+		if (perf)
+			Perf_end(perf, PerfPhase_FORWARD);
+		fwd += Os_time() - st;
+
+		st = Os_time();
+		if (perf)
+		{
+			// reset and backprop are counted separately, which costs one more barrier
+			Perf_begin(perf);
+			if (mt)
+				TopoMT_runPhases(mt, topo, TopoMT_PHASE_RESET);
+			else
+				Topo_resetGrads(topo);
+			Perf_end(perf, PerfPhase_RESET);
+
+			Perf_begin(perf);
+			if (mt)
+				TopoMT_runPhases(mt, topo, TopoMT_PHASE_BACKWARD);
+			else
+				Topo_backprop(topo);
+			Perf_end(perf, PerfPhase_BACKWARD);
+		}
+		else if (mt)
+			TopoMT_backward(mt, topo);
+		else
+			Topo_backward(topo);
+		bwd += Os_time() - st;
+
+		st = Os_time();
+		if (perf)
+			Perf_begin(perf);
+		if (mt)
+			Optim_stepMT(optim, mt);
+		else
+			Optim_step(optim);
+		if (perf)
+			Perf_end(perf, PerfPhase_UPDATE);
+		upd += Os_time() - st;
+	}
+	r.fwd_nps = (double)r.num_nodes * iters / fwd;
+	r.bwd_nps = (double)r.num_nodes * iters / bwd;
+	r.update_s = upd / iters;
+	r.peak_rss_kb = Bench_peakRss();
+
+	r.has_perf = (perf != 0);
+	if (perf)
+		memcpy(r.perf, perf->values, sizeof(r.perf));
+
+	if (mt)
+		TopoMT_delete(mt);
+	if (perf)
+		Perf_delete(perf);
+	Topo_delete(topo);
+	free(x);
+	free(pws);
+	Optim_delete(optim);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+	return r;
+}
+
+// runs Bench_run() in forked child, so peak RSS isn't inflated by previous configurations. Result is marked as failed when child dies
+BenchResult Bench_runIsolated(const int width, const int depth, const int batch, const int threads, const TopoMT_BACKWARD backward, const int iters, const char has_perf, const char pin)
+{
+	BenchResult failed = _Bench_config(width, depth, batch, threads, backward);
+	failed.failed = 1;
+	failed.has_perf = has_perf; // keeps CSV columns
+	memset(failed.perf, -1, sizeof(failed.perf));
+
+	int fds[2];
+	if (pipe(fds) != 0)
+		return failed;
+
+	fflush(stdout); // child would print it again
+	const pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(fds[0]);
+		BenchResult r = Bench_run(width, depth, batch, threads, backward, iters, has_perf, pin);
+		const char ok = (write(fds[1], &r, sizeof(BenchResult)) == sizeof(BenchResult));
+		_exit(ok ? 0 : 1);
+	}
+	close(fds[1]);
+
+	BenchResult r;
+	size_t n = 0;
+	while (pid > 0 && n < sizeof(BenchResult))
+	{
+		const ssize_t rd = read(fds[0], (char *)&r + n, sizeof(BenchResult) - n);
+		if (rd <= 0)
+			break;
+		n += rd;
+	}
+	close(fds[0]);
+	int status = 0;
+	if (pid > 0)
+		waitpid(pid, &status, 0);
+
+	// running it here would crash same way or report peak RSS of whole sweep
+	if (n != sizeof(BenchResult))
+	{
+		if (pid <= 0)
+			fprintf(stderr, "%s width %d batch %d threads %d: fork failed\n", failed.executor, width, batch, failed.threads);
+		else if (WIFSIGNALED(status))
+			fprintf(stderr, "%s width %d batch %d threads %d: killed by signal %d\n", failed.executor, width, batch, failed.threads, WTERMSIG(status));
+		else
+			fprintf(stderr, "%s width %d batch %d threads %d: exited with %d\n", failed.executor, width, batch, failed.threads, WEXITSTATUS(status));
+		return failed;
+	}
+	return r; // 'executor' points to literal, it has same address in child
+}
+
+// traces TopoMT_run() of one configuration into Chrome JSON, summary goes to stderr
+char Bench_trace(const char *path, const int width, const int batch, const int threads)
+{
+	ValueAllocator *va = ValueAllocator_new();
+	const int sizes[] = {width, width, 1};
+	MLP *mlp = MLP_new(width, sizes, 3);
+
+	Value **x = malloc(batch * width * sizeof(Value *));
+	Value **pws = malloc(batch * sizeof(Value *));
+	for (int i = 0; i < batch * width; i++)
+		x[i] = VA_const(va, Std_random11());
+	for (int j = 0; j < batch; j++)
+	{
+		Value *ypred = MLP_build(mlp, &x[j * width], va)[0];
+		pws[j] = VA_powConst(va, VA_sub(va, ypred, VA_const(va, Std_random11())), VA_const(va, 2));
+	}
+	Topo *topo = Topo_new(VA_sum(va, pws, batch));
+
+	TopoMT *mt = TopoMT_new(threads);
+	Trace *trace = Trace_new(threads, 1 << 16);
+	TopoMT_run(mt, topo); // warm up
+
+	Trace_reset(trace);
+	TopoMT_setTrace(mt, trace);
+	for (int k = 0; k < 10; k++)
+		TopoMT_run(mt, topo);
+	TopoMT_setTrace(mt, 0);
+
+	const char ok = Trace_writeChrome(trace, path);
+	fprintf(stderr, "Trace(width %d, batch %d, threads %d, 10 runs): %s\n", width, batch, threads, path);
+	Trace_printSummary(trace, stderr);
+
+	Trace_delete(trace);
+	TopoMT_delete(mt);
+	Topo_delete(topo);
+	free(x);
+	free(pws);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+	return ok;
+}
+
+void Bench_print(const BenchResult *r, const char json, const char first)
+{
+	if (json)
+	{
+		printf("%s\n  {\"executor\": \"%s\", \"width\": %d, \"depth\": %d, \"batch\": %d, \"threads\": %d, \"nodes\": %d, \"params\": %d, "
+			   "\"build_s\": %.6f, \"fwd_nodes_per_s\": %.0f, \"bwd_nodes_per_s\": %.0f, \"update_s\": %.6f, \"peak_rss_kb\": %ld, \"status\": \"%s\"",
+			   first ? "" : ",", r->executor, r->width, r->depth, r->batch, r->threads, r->num_nodes, r->num_params,
+			   r->build_s, r->fwd_nps, r->bwd_nps, r->update_s, r->peak_rss_kb, r->failed ? "failed" : "ok");
+		if (r->has_perf)
+		{
+			printf(", \"perf\": {");
+			for (int p = 0; p < PerfPhase_NUM; p++)
+			{
+				printf("%s\"%s\": {", p ? ", " : "", PerfPhase_NAMES[p]);
+				for (int i = 0; i < Perf_NUM; i++)
+					printf("%s\"%s\": %lld", i ? ", " : "", Perf_NAMES[i], r->perf[p][i]);
+				printf("}");
+			}
+			printf("}");
+		}
+		printf("}");
+	}
+	else
+	{
+		printf("%s,%d,%d,%d,%d,%d,%d,%.6f,%.0f,%.0f,%.6f,%ld,%s",
+			   r->executor, r->width, r->depth, r->batch, r->threads, r->num_nodes, r->num_params,
+			   r->build_s, r->fwd_nps, r->bwd_nps, r->update_s, r->peak_rss_kb, r->failed ? "failed" : "ok");
+		for (int p = 0; p < PerfPhase_NUM && r->has_perf; p++)
+			for (int i = 0; i < Perf_NUM; i++)
+				printf(",%lld", r->perf[p][i]);
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	char json = 0;
+	char quick = 0;
+	const char *trace = 0;
+	char perf = 0;
+	char pin = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--json") == 0)
+			json = 1;
+		else if (strcmp(argv[i], "--perf") == 0)
+			perf = 1;
+		else if (strcmp(argv[i], "--pin") == 0)
+			pin = 1;
+		else if (strcmp(argv[i], "--quick") == 0)
+			quick = 1;
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			trace = argv[++i];
+		else
+		{
+			printf("Usage: %s [--json] [--quick] [--perf] [--pin] [--trace trace.json]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	const int widths[] = {16, 64, 256};
+	const int batches[] = {1, 4, 16};
+	const int num_widths = quick ? 2 : 3;
+	const int num_batches = quick ? 2 : 3;
+	const int depth = 2;
+
+	// 1, 2, 4, .. up to # of usable CPUs
+	if (perf)
+	{
+		Perf *probe = Perf_new();
+		if (!Perf_isAvailable(probe))
+			fprintf(stderr, "perf counters are not available(no PMU or perf_event_paranoid), columns are -1\n");
+		Perf_delete(probe);
+	}
+
+	const int num_cpus = Std_numberOfThreads(); // affinity mask and cgroup quota
+	if (trace)
+		return Bench_trace(trace, 256, 4, Std_bmax(2, num_cpus)) ? 0 : 1;
+
+	int threads[16];
+	int num_threads = 0;
+	for (int t = 1; t < num_cpus && num_threads < 15; t *= 2)
+		threads[num_threads++] = t;
+	threads[num_threads++] = num_cpus;
+
+	if (json)
+		printf("[");
+	else
+	{
+		printf("executor,width,depth,batch,threads,nodes,params,build_s,fwd_nodes_per_s,bwd_nodes_per_s,update_s,peak_rss_kb,status");
+		for (int p = 0; p < PerfPhase_NUM && perf; p++)
+			for (int i = 0; i < Perf_NUM; i++)
+				printf(",%s_%s", PerfPhase_NAMES[p], Perf_NAMES[i]);
+		printf("\n");
+	}
+
+	char first = 1;
+	int num_failed = 0;
+	for (int w = 0; w < num_widths; w++)
+	{
+		for (int b = 0; b < num_batches; b++)
+		{
+			// keeps every configuration around same amount of work
+			const int iters = Std_bmax(3, (quick ? 2000000 : 20000000) / (widths[w] * widths[w] * batches[b]));
+
+			BenchResult r = Bench_runIsolated(widths[w], depth, batches[b], 0, TopoMT_BACKWARD_GATHER, iters, perf, pin);
+			Bench_print(&r, json, first);
+			num_failed += r.failed;
+			first = 0;
+
+			// gather vs scatter backward, scatter races on shared operands, so only its speed is meaningful
+			for (int t = 0; t < num_threads; t++)
+				for (int m = 0; m < 2; m++)
+				{
+					r = Bench_runIsolated(widths[w], depth, batches[b], threads[t], m ? TopoMT_BACKWARD_SCATTER : TopoMT_BACKWARD_GATHER, iters, perf, pin);
+					Bench_print(&r, json, first);
+					num_failed += r.failed;
+				}
+		}
+	}
+
+	if (json)
+		printf("\n]\n");
+	return num_failed ? 2 : 0;
+}
@@ -0,0 +1,187 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Checkpoint file(native byte order):
+// MLPFile header | int outputs[num_layers] | padding | per layer: double weights[outputs][inputs] | padding | double biases[outputs] | padding
+// Arrays are plain doubles aligned to MLPFile_ALIGN, so file doesn't depend on Value layout. MLP_load() maps file read-only,
+// pages come straight from page cache and are copied into ParamStore in one pass.
+
+#define MLPFile_MAGIC "cmgrad\0"
+#define MLPFile_VERSION 2
+#define MLPFile_ALIGN 64
+#define MLPFile_MAX_LAYERS 1024
+#define MLPFile_MAX_SIZE (1 << 20)	  // inputs or neurons of one layer
+#define MLPFile_MAX_PARAMS (1 << 30) // fits into int with room
+
+typedef struct MLPFile_s
+{
+	char magic[8];
+	unsigned int version;
+	int num_inputs;
+	int num_layers;
+	int num_params;
+	int params_offset; // from start of file
+} MLPFile;
+
+size_t _MLPFile_align(const size_t size)
+{
+	return (size + MLPFile_ALIGN - 1) / MLPFile_ALIGN * MLPFile_ALIGN;
+}
+
+// 'num_layers' must be <= MLPFile_MAX_LAYERS
+size_t _MLPFile_paramsOffset(const int num_layers)
+{
+	return _MLPFile_align(sizeof(MLPFile) + (size_t)num_layers * sizeof(int));
+}
+
+// same as MLP_numParams() for sizes from file, returns -1 if some size is out of limits or count is too big.
+// 'bytes' gets size of param arrays with padding
+int _MLPFile_numParams(const int num_inputs, const int *outputs, const int num_layers, size_t *bytes)
+{
+	if (num_inputs < 0 || num_inputs > MLPFile_MAX_SIZE || num_layers < 0 || num_layers > MLPFile_MAX_LAYERS)
+		return -1;
+
+	size_t n = 0;
+	*bytes = 0;
+	for (int i = 0; i < num_layers; i++)
+	{
+		if (outputs[i] <= 0 || outputs[i] > MLPFile_MAX_SIZE)
+			return -1;
+		const size_t w = (size_t)(i ? outputs[i - 1] : num_inputs) * outputs[i]; // < 2^40, can't overflow
+		n += w + outputs[i];
+		if (n > MLPFile_MAX_PARAMS)
+			return -1;
+		*bytes += _MLPFile_align(w * sizeof(double)) + _MLPFile_align(outputs[i] * sizeof(double));
+	}
+	return n;
+}
+
+// zeros up to next MLPFile_ALIGN, 'pos' is position in file
+char _MLPFile_pad(FILE *f, size_t *pos)
+{
+	const char zeros[MLPFile_ALIGN] = {0};
+	const size_t pad = _MLPFile_align(*pos) - *pos;
+	*pos += pad;
+	return pad == 0 || fwrite(zeros, pad, 1, f) == 1;
+}
+
+char MLP_save(MLP *self, const char *path)
+{
+	// sizes are kept in file, empty layer couldn't be loaded back
+	int outputs[Std_bmax(1, self->num_layers)];
+	for (int i = 0; i < self->num_layers; i++)
+		outputs[i] = self->layers[i].num;
+	const int num_inputs = (self->num_layers && self->layers[0].num) ? self->layers[0].neurons[0].num_inputs : 0;
+	size_t bytes;
+	if (_MLPFile_numParams(num_inputs, outputs, self->num_layers, &bytes) != self->params->num_values)
+		return 0;
+
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return 0;
+
+	MLPFile head;
+	memset(&head, 0, sizeof(MLPFile));
+	memcpy(head.magic, MLPFile_MAGIC, sizeof(head.magic));
+	head.version = MLPFile_VERSION;
+	head.num_inputs = num_inputs;
+	head.num_layers = self->num_layers;
+	head.num_params = self->params->num_values;
+	head.params_offset = _MLPFile_paramsOffset(self->num_layers);
+
+	char ok = (fwrite(&head, sizeof(MLPFile), 1, f) == 1);
+	if (ok && self->num_layers)
+		ok = (fwrite(outputs, sizeof(int), self->num_layers, f) == (size_t)self->num_layers);
+
+	// weights row by row, then biases. Every array is padded
+	size_t pos = sizeof(MLPFile) + self->num_layers * sizeof(int);
+	ok = ok && _MLPFile_pad(f, &pos);
+	for (int i = 0; i < self->num_layers && ok; i++)
+	{
+		Layer *layer = &self->layers[i];
+		const int num_in = layer->neurons[0].num_inputs;
+		double *row = malloc(Std_bmax(num_in, layer->num) * sizeof(double));
+		for (int j = 0; j < layer->num && ok; j++)
+		{
+			Neuron *n = &layer->neurons[j];
+			for (int k = 0; k < num_in; k++)
+				row[k] = n->w[k]->data;
+			ok = (num_in == 0 || fwrite(row, sizeof(double), num_in, f) == (size_t)num_in);
+		}
+		pos += (size_t)layer->num * num_in * sizeof(double);
+		ok = ok && _MLPFile_pad(f, &pos);
+
+		for (int j = 0; j < layer->num; j++)
+			row[j] = layer->neurons[j].b->data;
+		ok = ok && (fwrite(row, sizeof(double), layer->num, f) == (size_t)layer->num);
+		pos += layer->num * sizeof(double);
+		ok = ok && _MLPFile_pad(f, &pos);
+		free(row);
+	}
+
+	if (fclose(f) != 0)
+		ok = 0;
+	return ok;
+}
+
+// returns 0 if file is missing or broken
+MLP *MLP_load(const char *path)
+{
+	StdMap map;
+	if (!StdMap_open(&map, path))
+		return 0;
+
+	// header is checked before anything else is read. Sizes are limited, so offsets below fit into size_t
+	const MLPFile *head = map.ptr;
+	const int *outputs = (const int *)(head + 1);
+	size_t bytes = 0;
+	char ok = (map.size >= sizeof(MLPFile) &&
+			   memcmp(head->magic, MLPFile_MAGIC, sizeof(head->magic)) == 0 &&
+			   head->version == MLPFile_VERSION &&
+			   head->num_layers >= 0 && head->num_layers <= MLPFile_MAX_LAYERS &&
+			   head->num_params >= 0 && head->num_params <= MLPFile_MAX_PARAMS &&
+			   head->params_offset >= 0 && (size_t)head->params_offset == _MLPFile_paramsOffset(head->num_layers) &&
+			   map.size >= (size_t)head->params_offset); // outputs are before params_offset
+	if (ok)
+		ok = (_MLPFile_numParams(head->num_inputs, outputs, head->num_layers, &bytes) == head->num_params &&
+			  map.size >= (size_t)head->params_offset + bytes);
+	if (!ok)
+	{
+		StdMap_free(&map);
+		return 0;
+	}
+
+	// one pass in ParamStore order(weights of neuron, its bias), mapping isn't needed after that
+	ParamStore *params = ParamStore_new(head->num_params);
+	const char *p = (const char *)map.ptr + head->params_offset;
+	for (int i = 0; i < head->num_layers; i++)
+	{
+		const int num_in = i ? outputs[i - 1] : head->num_inputs;
+		const double *w = (const double *)p;
+		const double *b = (const double *)(p + _MLPFile_align((size_t)outputs[i] * num_in * sizeof(double)));
+		for (int j = 0; j < outputs[i]; j++)
+		{
+			for (int k = 0; k < num_in; k++)
+				ParamStore_add(params, w[(size_t)j * num_in + k]);
+			ParamStore_add(params, b[j]);
+		}
+		p = (const char *)b + _MLPFile_align(outputs[i] * sizeof(double));
+	}
+	MLP *self = MLP_newParams(head->num_inputs, outputs, head->num_layers, params);
+
+	StdMap_free(&map);
+	return self;
+}
@@ -0,0 +1,200 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// measured time(ns) of Value_forward()/Value_backward() per op, TopoMT uses it to decide how to run layers
+typedef struct TopoCost_s
+{
+	double fwd[Value_OP_SUM + 1];
+	double bwd[Value_OP_SUM + 1];
+	double fwd_arg[Value_OP_SUM + 1]; // + per operand of n-ary op
+	double bwd_arg[Value_OP_SUM + 1];
+	double gather[Value_OP_SUM + 1]; // gather backward: per edge to user with this op(Value_partial() * grad)
+} TopoCost;
+
+// best of few runs, ns per value
+double _TopoCost_measure(Value **values, const int n, const char backward)
+{
+	double best = 1e30;
+	for (int r = 0; r < 5; r++)
+	{
+		const double st = Os_timeMono();
+		if (backward)
+		{
+			for (int i = 0; i < n; i++)
+				Value_backward(values[i]);
+		}
+		else
+		{
+			for (int i = 0; i < n; i++)
+				Value_forward(values[i]);
+		}
+		best = fmin(best, Os_timeMono() - st);
+	}
+	return best * 1e9 / n;
+}
+
+// best of few runs, ns per operand of Topo_gather()
+double _TopoCost_measureGather(Value **values, const int n)
+{
+	double best = 1e30;
+	int edges = 0;
+	volatile double sink = 0;
+	for (int r = 0; r < 5; r++)
+	{
+		const double st = Os_timeMono();
+		double g = 0;
+		edges = 0;
+		for (int i = 0; i < n; i++)
+		{
+			int num;
+			Value **prevs = Value_getPrevs(values[i], &num);
+			for (int p = 0; p < num; p++)
+				if (prevs[p])
+				{
+					g += Value_partial(values[i], p) * values[i]->grad;
+					edges++;
+				}
+		}
+		best = fmin(best, Os_timeMono() - st);
+		sink += g;
+	}
+	return best * 1e9 / Std_bmax(1, edges);
+}
+
+// 'num_args' is used only by n-ary ops
+void _TopoCost_measureOp(ValueAllocator *va, Value **leaves, const int num_leaves, const Value_OP op, const int num_args, Value **values, const int n, double *fwd, double *bwd, double *gather)
+{
+	Value *two = VA_const(va, 2);
+	for (int i = 0; i < n; i++)
+	{
+		Value *a = leaves[i % num_leaves];
+		Value *b = leaves[(i * 7 + 1) % num_leaves];
+		Value **args = &leaves[(i * 13) % (num_leaves - 2 * num_args)];
+		switch (op)
+		{
+		case Value_OP_ADD:
+			values[i] = VA_add(va, a, b);
+			break;
+		case Value_OP_SUB:
+			values[i] = VA_sub(va, a, b);
+			break;
+		case Value_OP_MUL:
+			values[i] = VA_mul(va, a, b);
+			break;
+		case Value_OP_DIV:
+			values[i] = VA_div(va, a, b);
+			break;
+		case Value_OP_POW_CONST:
+			values[i] = VA_powConst(va, a, two);
+			break;
+		case Value_OP_NEG:
+			values[i] = VA_neg(va, a);
+			break;
+		case Value_OP_TANH:
+			values[i] = VA_tanh(va, a);
+			break;
+		case Value_OP_RELU:
+			values[i] = VA_relu(va, a);
+			break;
+		case Value_OP_DOT:
+			values[i] = VA_dot(va, args, args + num_args, num_args);
+			break;
+		case Value_OP_SUM:
+			values[i] = VA_sum(va, args, num_args);
+			break;
+		default:
+			values[i] = a;
+			break;
+		}
+		values[i]->grad = 1;
+	}
+
+	*fwd = _TopoCost_measure(values, n, 0);
+	*bwd = _TopoCost_measure(values, n, 1);
+	*gather = _TopoCost_measureGather(values, n);
+}
+
+void _TopoCost_calibrate(TopoCost *self)
+{
+	memset(self, 0, sizeof(TopoCost));
+
+	const int num_leaves = 4096;
+	const int n = 1024;
+	ValueAllocator *va = ValueAllocator_new();
+	Value **leaves = malloc(num_leaves * sizeof(Value *));
+	Value **values = malloc(n * sizeof(Value *));
+	for (int i = 0; i < num_leaves; i++)
+		leaves[i] = VA_const(va, 1 + 0.5 * Std_random11()); // DIV never gets 0
+
+	for (int op = Value_OP_ADD; op <= Value_OP_SUM; op++)
+	{
+		if (op == Value_OP_DOT || op == Value_OP_SUM)
+		{
+			// cost = base + num_args * per_arg
+			double f4, b4, g4, f64, b64;
+			_TopoCost_measureOp(va, leaves, num_leaves, op, 4, values, n, &f4, &b4, &g4);
+			_TopoCost_measureOp(va, leaves, num_leaves, op, 64, values, n, &f64, &b64, &self->gather[op]);
+			self->fwd_arg[op] = fmax(0, (f64 - f4) / 60);
+			self->bwd_arg[op] = fmax(0, (b64 - b4) / 60);
+			self->fwd[op] = fmax(0, f4 - 4 * self->fwd_arg[op]);
+			self->bwd[op] = fmax(0, b4 - 4 * self->bwd_arg[op]);
+		}
+		else
+			_TopoCost_measureOp(va, leaves, num_leaves, op, 0, values, n, &self->fwd[op], &self->bwd[op], &self->gather[op]);
+	}
+
+	free(values);
+	free(leaves);
+	ValueAllocator_delete(va);
+}
+
+// calibrated at first call(few ms)
+const TopoCost *TopoCost_get(void)
+{
+	static TopoCost cost;
+	static char done = 0;
+	if (!done)
+	{
+		_TopoCost_calibrate(&cost);
+		done = 1;
+	}
+	return &cost;
+}
+
+// estimated ns of one value
+double TopoCost_value(const TopoCost *self, const Value *v, const char backward)
+{
+	double ns = backward ? self->bwd[v->op] : self->fwd[v->op];
+	if (v->op == Value_OP_DOT || v->op == Value_OP_SUM)
+		ns += v->num_args * (backward ? self->bwd_arg[v->op] : self->fwd_arg[v->op]);
+	return ns;
+}
+
+// estimated ns of Topo_gather() of value with index 'i', it sums partials of all its users. Topo_buildUsers() must be called before
+double TopoCost_gather(const TopoCost *self, const Topo *topo, const int i)
+{
+	double ns = 0;
+	for (int u = topo->user_offsets[i]; u < topo->user_offsets[i + 1]; u++)
+		ns += self->gather[topo->users[u].user->op];
+	return ns;
+}
+
+void TopoCost_print(const TopoCost *self)
+{
+	const char *names[] = {"empty", "add", "sub", "mul", "div", "pow", "neg", "tanh", "relu", "dot", "sum"};
+	for (int op = Value_OP_ADD; op <= Value_OP_SUM; op++)
+		printf("%s: forward %.1fns + %.2fns/arg, backward %.1fns + %.2fns/arg, gather %.2fns/user\n", names[op], self->fwd[op], self->fwd_arg[op], self->bwd[op], self->bwd_arg[op], self->gather[op]);
+}
@@ -0,0 +1,241 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Dataset file(native byte order):
+// DatasetFile header | double samples[num_samples][num_inputs + num_outputs]
+// File is mapped, background thread shuffles samples and prefetches next batch while current one is trained.
+
+#define DatasetFile_MAGIC "cmgdata"
+#define DatasetFile_VERSION 1
+#define DatasetFile_MAX_SIZE (1 << 20) // inputs or outputs of one sample
+
+typedef struct DatasetFile_s
+{
+	char magic[8];
+	unsigned int version;
+	int num_inputs;
+	int num_outputs;
+	int num_samples;
+} DatasetFile;
+
+// sizes are limited, so sizes computed from them in size_t can't overflow
+char _DatasetFile_isValid(const int num_samples, const int num_inputs, const int num_outputs)
+{
+	return num_samples > 0 && num_inputs >= 0 && num_inputs <= DatasetFile_MAX_SIZE && num_outputs >= 0 && num_outputs <= DatasetFile_MAX_SIZE;
+}
+
+// 'samples' are rows of inputs followed by outputs
+char Dataset_write(const char *path, const double *samples, const int num_samples, const int num_inputs, const int num_outputs)
+{
+	if (!_DatasetFile_isValid(num_samples, num_inputs, num_outputs))
+		return 0; // couldn't be opened back
+
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return 0;
+
+	DatasetFile head;
+	memset(&head, 0, sizeof(DatasetFile));
+	memcpy(head.magic, DatasetFile_MAGIC, sizeof(head.magic));
+	head.version = DatasetFile_VERSION;
+	head.num_inputs = num_inputs;
+	head.num_outputs = num_outputs;
+	head.num_samples = num_samples;
+
+	const size_t n = (size_t)num_samples * ((size_t)num_inputs + num_outputs);
+	char ok = (fwrite(&head, sizeof(DatasetFile), 1, f) == 1);
+	if (ok && n)
+		ok = (fwrite(samples, sizeof(double), n, f) == n);
+
+	if (fclose(f) != 0)
+		ok = 0;
+	return ok;
+}
+
+typedef struct Dataset_s
+{
+	StdMap map;
+	const double *samples;
+	int num_inputs;
+	int num_outputs;
+	int num_samples;
+
+	int batch;
+	int epoch; // # of finished passes over dataset(prefetch side)
+
+	// shuffled order of samples, owned by prefetch thread
+	int *order;
+	int pos;
+	unsigned long long rnd;
+
+	// double buffer, every buffer is batch x (num_inputs + num_outputs)
+	double *buffers[2];
+	int i_buffer; // buffer which is read by Dataset_next()
+
+	StdThread thread;
+	OsSemaphore semaphore_free;	 // buffer can be refilled
+	OsSemaphore semaphore_ready; // buffer is filled
+	int exit; // atomic, set by Dataset_delete()
+} Dataset;
+
+unsigned int _Dataset_random(Dataset *self)
+{
+	// xorshift64
+	unsigned long long x = self->rnd;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	self->rnd = x;
+	return x >> 32;
+}
+
+void _Dataset_shuffle(Dataset *self)
+{
+	for (int i = self->num_samples - 1; i > 0; i--)
+	{
+		const int j = _Dataset_random(self) % (i + 1);
+		const int t = self->order[i];
+		self->order[i] = self->order[j];
+		self->order[j] = t;
+	}
+}
+
+void _Dataset_fill(Dataset *self, double *dst)
+{
+	const size_t row = (size_t)self->num_inputs + self->num_outputs;
+	for (int j = 0; j < self->batch; j++)
+	{
+		if (self->pos == self->num_samples)
+		{
+			// next epoch
+			self->pos = 0;
+			self->epoch++;
+			_Dataset_shuffle(self);
+		}
+
+		memcpy(&dst[(size_t)j * row], &self->samples[(size_t)self->order[self->pos++] * row], row * sizeof(double));
+	}
+}
+
+StdThread_FUNC(Dataset_loop, arg)
+{
+	Dataset *self = arg;
+
+	int k = 0;
+	while (1)
+	{
+		OsSemaphore_wait(&self->semaphore_free);
+		if (__atomic_load_n(&self->exit, __ATOMIC_ACQUIRE))
+			break;
+
+		_Dataset_fill(self, self->buffers[k]);
+		OsSemaphore_trigger(&self->semaphore_ready);
+		k ^= 1;
+	}
+	return 0;
+}
+
+// returns 0 if file is missing or broken
+Dataset *Dataset_open(const char *path, const int batch)
+{
+	StdMap map;
+	if (!StdMap_open(&map, path))
+		return 0;
+
+	const DatasetFile *head = map.ptr;
+	char ok = (map.size >= sizeof(DatasetFile) &&
+			   memcmp(head->magic, DatasetFile_MAGIC, sizeof(head->magic)) == 0 &&
+			   head->version == DatasetFile_VERSION &&
+			   _DatasetFile_isValid(head->num_samples, head->num_inputs, head->num_outputs) &&
+			   map.size >= sizeof(DatasetFile) + (size_t)head->num_samples * ((size_t)head->num_inputs + head->num_outputs) * sizeof(double));
+	if (!ok || batch <= 0)
+	{
+		StdMap_free(&map);
+		return 0;
+	}
+
+	Dataset *self = malloc(sizeof(Dataset));
+	self->map = map;
+	self->samples = (const double *)(head + 1);
+	self->num_inputs = head->num_inputs;
+	self->num_outputs = head->num_outputs;
+	self->num_samples = head->num_samples;
+	self->batch = batch;
+	self->epoch = 0;
+
+	self->order = malloc(self->num_samples * sizeof(int));
+	for (int i = 0; i < self->num_samples; i++)
+		self->order[i] = i;
+	self->pos = 0;
+	Std_random(sizeof(self->rnd), &self->rnd);
+	self->rnd |= 1; // xorshift can't start from 0
+	_Dataset_shuffle(self);
+
+	const size_t size = (size_t)batch * ((size_t)self->num_inputs + self->num_outputs) * sizeof(double);
+	self->buffers[0] = malloc(size);
+	self->buffers[1] = malloc(size);
+	self->i_buffer = 0;
+
+	OsSemaphore_init(&self->semaphore_free);
+	OsSemaphore_init(&self->semaphore_ready);
+	self->exit = 0;
+
+	// both buffers are free
+	OsSemaphore_trigger(&self->semaphore_free);
+	OsSemaphore_trigger(&self->semaphore_free);
+	StdThread_init(&self->thread, "Dataset", &Dataset_loop, self);
+
+	return self;
+}
+
+void Dataset_delete(Dataset *self)
+{
+	__atomic_store_n(&self->exit, 1, __ATOMIC_RELEASE);
+	OsSemaphore_trigger(&self->semaphore_free);
+	StdThread_free(&self->thread);
+
+	OsSemaphore_free(&self->semaphore_free);
+	OsSemaphore_free(&self->semaphore_ready);
+
+	free(self->buffers[0]);
+	free(self->buffers[1]);
+	free(self->order);
+	StdMap_free(&self->map);
+
+	memset(self, 0, sizeof(Dataset));
+	free(self);
+}
+
+// writes next batch into Values. Sample j uses inputs[j * num_inputs .. ] and outputs[j * num_outputs .. ], 'outputs' can be 0
+void Dataset_next(Dataset *self, Value **inputs, Value **outputs)
+{
+	OsSemaphore_wait(&self->semaphore_ready);
+
+	const double *src = self->buffers[self->i_buffer];
+	for (int j = 0; j < self->batch; j++)
+	{
+		for (int i = 0; i < self->num_inputs; i++)
+			inputs[(size_t)j * self->num_inputs + i]->data = *src++;
+
+		for (int i = 0; i < self->num_outputs; i++, src++)
+			if (outputs)
+				outputs[(size_t)j * self->num_outputs + i]->data = *src;
+	}
+
+	// thread can refill it
+	OsSemaphore_trigger(&self->semaphore_free);
+	self->i_buffer ^= 1;
+}
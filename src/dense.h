@@ -0,0 +1,307 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Dense runs MLP as matrices instead of Value graph. Weights of every Layer are packed into row-major matrix,
+// whole batch goes through layer as one matrix multiply(C += A * B) with register-blocked micro-kernel.
+// Activations use same tanh formula as Value_forward(), only order of additions in dot products differs,
+// so results match graph execution up to rounding.
+
+#if defined(__AVX512F__)
+#define Dense_NR 16 // columns of micro-tile
+#define Dense_VW 8	// doubles in vector
+typedef __m512d _DenseVec;
+#define _Dense_load(p) _mm512_loadu_pd(p)
+#define _Dense_store(p, v) _mm512_storeu_pd(p, v)
+#define _Dense_set1(x) _mm512_set1_pd(x)
+#define _Dense_fma(a, b, c) _mm512_fmadd_pd(a, b, c)
+#elif defined(__AVX2__) && defined(__FMA__)
+#define Dense_NR 8
+#define Dense_VW 4
+typedef __m256d _DenseVec;
+#define _Dense_load(p) _mm256_loadu_pd(p)
+#define _Dense_store(p, v) _mm256_storeu_pd(p, v)
+#define _Dense_set1(x) _mm256_set1_pd(x)
+#define _Dense_fma(a, b, c) _mm256_fmadd_pd(a, b, c)
+#else
+#define Dense_NR 4
+#define Dense_VW 1
+typedef double _DenseVec;
+#define _Dense_load(p) (*(p))
+#define _Dense_store(p, v) (*(p) = (v))
+#define _Dense_set1(x) (x)
+#define _Dense_fma(a, b, c) ((a) * (b) + (c))
+#endif
+
+#define Dense_MR 4	 // rows of micro-tile, MR x NR accumulators stay in registers
+#define Dense_KC 128 // depth of block, KC x NC panel of B stays in L2
+#define Dense_NC 256
+#define Dense_MC 64 // forward rows per pass, tanh runs while they are still in cache
+
+// full MR x NR tile
+void _Dense_kernel(const int kn, const double *a, const size_t ars, const size_t acs, const double *b, const size_t ldb, double *c, const size_t ldc)
+{
+	_DenseVec acc[Dense_MR][Dense_NR / Dense_VW];
+	for (int r = 0; r < Dense_MR; r++)
+		for (int v = 0; v < Dense_NR / Dense_VW; v++)
+			acc[r][v] = _Dense_load(c + r * ldc + v * Dense_VW);
+
+	for (int k = 0; k < kn; k++)
+	{
+		const double *bk = b + k * ldb;
+		_DenseVec bv[Dense_NR / Dense_VW];
+		for (int v = 0; v < Dense_NR / Dense_VW; v++)
+			bv[v] = _Dense_load(bk + v * Dense_VW);
+
+		for (int r = 0; r < Dense_MR; r++)
+		{
+			const _DenseVec av = _Dense_set1(a[r * ars + k * acs]);
+			for (int v = 0; v < Dense_NR / Dense_VW; v++)
+				acc[r][v] = _Dense_fma(av, bv[v], acc[r][v]);
+		}
+	}
+
+	for (int r = 0; r < Dense_MR; r++)
+		for (int v = 0; v < Dense_NR / Dense_VW; v++)
+			_Dense_store(c + r * ldc + v * Dense_VW, acc[r][v]);
+}
+
+// partial tile at matrix edge
+void _Dense_kernelEdge(const int mr, const int nr, const int kn, const double *a, const size_t ars, const size_t acs, const double *b, const size_t ldb, double *c, const size_t ldc)
+{
+	for (int r = 0; r < mr; r++)
+		for (int j = 0; j < nr; j++)
+		{
+			double s = c[r * ldc + j];
+			for (int k = 0; k < kn; k++)
+				s += a[r * ars + k * acs] * b[k * ldb + j];
+			c[r * ldc + j] = s;
+		}
+}
+
+// C[M x N] += A[M x K] * B[K x N]. A(m, k) is A[m * ars + k * acs], so transposed A costs nothing. B and C are row-major
+void _Dense_gemm(const int M, const int N, const int K, const double *A, const size_t ars, const size_t acs, const double *B, const size_t ldb, double *C, const size_t ldc)
+{
+	for (int kc = 0; kc < K; kc += Dense_KC)
+	{
+		const int kn = Std_bmin(Dense_KC, K - kc);
+		for (int nc = 0; nc < N; nc += Dense_NC)
+		{
+			const int nn = Std_bmin(Dense_NC, N - nc);
+			for (int m = 0; m < M; m += Dense_MR)
+				for (int n = nc; n < nc + nn; n += Dense_NR)
+				{
+					const double *a = A + m * ars + kc * acs;
+					const double *b = B + kc * ldb + n;
+					double *c = C + m * ldc + n;
+					if (M - m >= Dense_MR && nc + nn - n >= Dense_NR)
+						_Dense_kernel(kn, a, ars, acs, b, ldb, c, ldc);
+					else
+						_Dense_kernelEdge(Std_bmin(Dense_MR, M - m), Std_bmin(Dense_NR, nc + nn - n), kn, a, ars, acs, b, ldb, c, ldc);
+				}
+		}
+	}
+}
+
+typedef struct DenseLayer_s
+{
+	int num_inputs;
+	int num_outputs;
+
+	double *w;	// num_outputs x num_inputs, row j = weights of neuron j
+	double *wt; // transposed 'w', forward streams its rows
+	double *b;
+	double *gw; // grads of 'w' and 'b'
+	double *gb;
+
+	double *y;	// batch x num_outputs, activations
+	double *dy; // batch x num_outputs, grads of activations. Backward turns them into grads of pre-activations
+} DenseLayer;
+
+typedef struct Dense_s
+{
+	MLP *mlp;
+	int batch;
+
+	DenseLayer *layers;
+	int num_layers;
+
+	double *x;	// batch x num_inputs, caller fills inputs here
+	double *dx; // grads of 'x'
+} Dense;
+
+Dense *Dense_new(MLP *mlp, const int batch)
+{
+	Dense *self = malloc(sizeof(Dense));
+	self->mlp = mlp;
+	self->batch = batch;
+	self->num_layers = mlp->num_layers;
+	self->layers = malloc(self->num_layers * sizeof(DenseLayer));
+
+	for (int i = 0; i < self->num_layers; i++)
+	{
+		DenseLayer *l = &self->layers[i];
+		l->num_outputs = mlp->layers[i].num;
+		l->num_inputs = mlp->layers[i].neurons[0].num_inputs;
+
+		const size_t W = (size_t)l->num_outputs * l->num_inputs;
+		const size_t Y = (size_t)batch * l->num_outputs;
+		l->w = malloc(W * sizeof(double));
+		l->wt = malloc(W * sizeof(double));
+		l->gw = malloc(W * sizeof(double));
+		l->b = malloc(l->num_outputs * sizeof(double));
+		l->gb = malloc(l->num_outputs * sizeof(double));
+		l->y = malloc(Y * sizeof(double));
+		l->dy = malloc(Y * sizeof(double));
+		memset(l->gw, 0, W * sizeof(double));
+		memset(l->gb, 0, l->num_outputs * sizeof(double));
+	}
+
+	const size_t X = (size_t)batch * self->layers[0].num_inputs;
+	self->x = malloc(X * sizeof(double));
+	self->dx = malloc(X * sizeof(double));
+	memset(self->x, 0, X * sizeof(double));
+
+	return self;
+}
+
+void Dense_delete(Dense *self)
+{
+	for (int i = 0; i < self->num_layers; i++)
+	{
+		DenseLayer *l = &self->layers[i];
+		free(l->w);
+		free(l->wt);
+		free(l->gw);
+		free(l->b);
+		free(l->gb);
+		free(l->y);
+		free(l->dy);
+	}
+	memset(self->layers, 0, self->num_layers * sizeof(DenseLayer));
+	free(self->layers);
+
+	free(self->x);
+	free(self->dx);
+
+	memset(self, 0, sizeof(Dense));
+	free(self);
+}
+
+// packs weights from MLP params, call it after every update
+void Dense_load(Dense *self)
+{
+	for (int i = 0; i < self->num_layers; i++)
+	{
+		DenseLayer *l = &self->layers[i];
+		for (int j = 0; j < l->num_outputs; j++)
+		{
+			Neuron *n = &self->mlp->layers[i].neurons[j];
+			for (int k = 0; k < l->num_inputs; k++)
+			{
+				l->w[(size_t)j * l->num_inputs + k] = n->w[k]->data;
+				l->wt[(size_t)k * l->num_outputs + j] = n->w[k]->data;
+			}
+			l->b[j] = n->b->data;
+		}
+	}
+}
+
+// copies grads of weights and biases into MLP params(summed over batch)
+void Dense_store(Dense *self)
+{
+	for (int i = 0; i < self->num_layers; i++)
+	{
+		DenseLayer *l = &self->layers[i];
+		for (int j = 0; j < l->num_outputs; j++)
+		{
+			Neuron *n = &self->mlp->layers[i].neurons[j];
+			for (int k = 0; k < l->num_inputs; k++)
+				n->w[k]->grad = l->gw[(size_t)j * l->num_inputs + k];
+			n->b->grad = l->gb[j];
+		}
+	}
+}
+
+// batch x num_outputs of last layer
+double *Dense_outputs(Dense *self)
+{
+	return self->layers[self->num_layers - 1].y;
+}
+
+void _Dense_forwardLayer(DenseLayer *l, const double *x, const int batch)
+{
+	const int N = l->num_outputs;
+	const int K = l->num_inputs;
+	for (int m = 0; m < batch; m += Dense_MC)
+	{
+		const int mn = Std_bmin(Dense_MC, batch - m);
+		double *y = l->y + (size_t)m * N;
+
+		// b + w * x
+		for (int i = 0; i < mn; i++)
+			memcpy(y + (size_t)i * N, l->b, N * sizeof(double));
+		_Dense_gemm(mn, N, K, x + (size_t)m * K, K, 1, l->wt, N, y, N);
+
+		for (size_t i = 0; i < (size_t)mn * N; i++)
+		{
+			const double ex = exp(2 * y[i]);
+			y[i] = (ex - 1) / (ex + 1);
+		}
+	}
+}
+
+void Dense_forward(Dense *self)
+{
+	const double *x = self->x;
+	for (int i = 0; i < self->num_layers; i++)
+	{
+		_Dense_forwardLayer(&self->layers[i], x, self->batch);
+		x = self->layers[i].y;
+	}
+}
+
+// 'dy' are grads of outputs(batch x num_outputs of last layer). Grads of weights are computed for whole batch, grads of inputs go to 'dx'
+void Dense_backward(Dense *self, const double *dy)
+{
+	const int B = self->batch;
+	DenseLayer *last = &self->layers[self->num_layers - 1];
+	memcpy(last->dy, dy, (size_t)B * last->num_outputs * sizeof(double));
+
+	for (int i = self->num_layers - 1; i >= 0; i--)
+	{
+		DenseLayer *l = &self->layers[i];
+		const int N = l->num_outputs;
+		const int K = l->num_inputs;
+		const double *x = i ? self->layers[i - 1].y : self->x;
+		double *dx = i ? self->layers[i - 1].dy : self->dx;
+
+		// through tanh
+		for (size_t ii = 0; ii < (size_t)B * N; ii++)
+			l->dy[ii] *= 1 - (l->y[ii] * l->y[ii]);
+
+		// gw = dy^T * x, gb = sum of dy rows
+		memset(l->gw, 0, (size_t)N * K * sizeof(double));
+		_Dense_gemm(N, K, B, l->dy, 1, N, x, K, l->gw, K);
+		memset(l->gb, 0, N * sizeof(double));
+		for (int m = 0; m < B; m++)
+			for (int j = 0; j < N; j++)
+				l->gb[j] += l->dy[(size_t)m * N + j];
+
+		// dx = dy * w
+		memset(dx, 0, (size_t)B * K * sizeof(double));
+		_Dense_gemm(B, K, N, l->dy, N, 1, l->w, K, dx, K);
+	}
+}
@@ -86,7 +86,7 @@ void example3(void)
 	Value *x[] = {VA_const(va, 2), VA_const(va, 3), VA_const(va, -1)};
 
 	const int ioSizes[] = {4, 4, 1};
-	MLP *mlp = MLP_new(3, ioSizes, 3, va);
+	MLP *mlp = MLP_new(3, ioSizes, 3);
 
 	Value **ret = MLP_build(mlp, x, va);
 
@@ -119,62 +119,754 @@ void example4(void)
 
 	// inits MLP
 	const int ioSizes[] = {4, 4, 1};
-	MLP *mlp = MLP_new(3, ioSizes, 3, va);
+	MLP *mlp = MLP_new(3, ioSizes, 3);
 
 	TopoMT *topoParalel = TopoMT_new(NUMBER_OF_THREADS);
+	Optim *optim = Optim_newAdam(mlp->params, 0.05, 0.9, 0.999, 1e-8, 0);
 
-	// builds MLP topo
-	Topo *topoMLP[xs_n];
+	// builds MLP for all samples in parallel, every thread has own arena
+	ValueAllocator_setChildren(va, topoParalel->num_threads);
+	Value **xsp[xs_n];
+	Value **ysp[xs_n];
+	for (int j = 0; j < xs_n; j++)
+		xsp[j] = xs[j];
+	MLP_buildBatch(mlp, xsp, ysp, xs_n, va);
+
+	// per-sample losses
 	Value *ypred[xs_n];
+	Value *pws[xs_n];
 	for (int j = 0; j < xs_n; j++)
 	{
-		ypred[j] = MLP_build(mlp, xs[j], va)[0];
-		topoMLP[j] = Topo_new(ypred[j]);
+		ypred[j] = ysp[j][0];
+		Value *sub = VA_sub(va, ypred[j], ys[j]);
+		pws[j] = VA_powConst(va, sub, VA_const(va, 2));
 	}
 
-	// builds Loss TOPO
-	Value *loss = VA_const(va, 0);
-	for (int j = 0; j < xs_n; j++) // sum
+	// one topo for all samples, they fill same layers and weights accumulate grads from all of them
+	Topo *topo = Topo_newMulti(pws, xs_n);
+	//Topo_print(topo);
+
+	// trains network
+	double st = Os_time();
+	const int kkN = 20;
+	for (int kk = 0; kk < kkN; kk++)
 	{
-		Value *sub = VA_sub(va, ypred[j], ys[j]);
-		Value *pw = VA_powConst(va, sub, VA_const(va, 2));
-		loss = VA_add(va, loss, pw);
+		// forward + backward pass of whole batch
+		TopoMT_run(topoParalel, topo); // Topo_run(topo);
+
+		// update, weights are shared by all samples
+		Optim_stepMT(optim, topoParalel);
+
+		double loss = 0;
+		for (int j = 0; j < xs_n; j++)
+			loss += pws[j]->data;
+		printf("[%d] ret: %f\n", kk, loss);
 	}
-	Topo *topoLoss = Topo_new(loss);
 
-	//for (int j = 0; j < xs_n; j++)
-	//	Topo_print(topoMLP[j]);
-	//Topo_print(topoLoss);
+	for (int j = 0; j < xs_n; j++)
+		printf("ypred: %f\n", ypred[j]->data);
+
+	printf("Trained in %fs\n", Os_time() - st);
+
+	// cleaning
+	Optim_delete(optim);
+	TopoMT_delete(topoParalel);
+	Topo_delete(topo);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+}
+
+void example5(void)
+{
+	ValueAllocator *va = ValueAllocator_new();
+
+	Value *x[] = {VA_const(va, 2), VA_const(va, 3), VA_const(va, -1)};
+
+	const int ioSizes[] = {16, 16, 1};
+	MLP *mlp = MLP_new(3, ioSizes, 3);
+
+	Value **ret = MLP_build(mlp, x, va);
+
+	Topo *topo = Topo_new(ret[0]);
+	Topo_run(topo);
+	printf("topo: %f | %f\n", ret[0]->data, x[0]->grad);
+
+	// compiled version of the same graph
+	Tape *tape = Tape_compile(topo);
+	Tape_load(tape);
+	Tape_run(tape);
+	Tape_store(tape);
+	printf("tape: %f | %f\n", ret[0]->data, x[0]->grad);
+
+	// dataflow execution of the same tape
+	TopoDF *topoDF = TopoDF_new(tape, NUMBER_OF_THREADS);
+	TopoDF_run(topoDF);
+	Tape_store(tape);
+	printf("dataflow: %f | %f\n", ret[0]->data, x[0]->grad);
+	TopoDF_delete(topoDF);
+
+	Tape_delete(tape);
+	Topo_delete(topo);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+}
+
+void example6(void)
+{
+	ValueAllocator *va = ValueAllocator_new();
+
+	Value *x[64];
+	for (int i = 0; i < 64; i++)
+		x[i] = VA_const(va, Std_random11());
+
+	const int ioSizes[] = {64, 64, 1};
+	MLP *mlp = MLP_new(64, ioSizes, 3);
+
+	Value **ret = MLP_build(mlp, x, va);
+	Topo *topo = Topo_new(ret[0]);
+
+	// single thread reference
+	Topo_run(topo);
+	const double grad = x[0]->grad;
+
+	// every neuron reads same x[i], so scatter races on x[i].grad
+	TopoMT *topoParalel = TopoMT_new(NUMBER_OF_THREADS);
+	for (int mode = 0; mode < 2; mode++)
+	{
+		TopoMT_setBackward(topoParalel, mode ? TopoMT_BACKWARD_SCATTER : TopoMT_BACKWARD_GATHER);
+
+		double maxDiff = 0;
+		double st = Os_time();
+		for (int i = 0; i < 100; i++)
+		{
+			TopoMT_run(topoParalel, topo);
+			maxDiff = fmax(maxDiff, fabs(x[0]->grad - grad));
+		}
+		printf("%s: %fms, max grad error: %g\n", mode ? "scatter" : "gather", (Os_time() - st) * 1000 / 100, maxDiff);
+	}
+	TopoMT_delete(topoParalel);
+
+	Topo_delete(topo);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+}
+
+void example7(void)
+{
+	ValueAllocator *va = ValueAllocator_new();
+
+	// one graph for whole minibatch, inputs and desire output are set per lane
+	Value *x[] = {VA_const(va, 0), VA_const(va, 0), VA_const(va, 0)};
+	Value *y = VA_const(va, 0);
+
+	const int ioSizes[] = {4, 4, 1};
+	MLP *mlp = MLP_new(3, ioSizes, 3);
+
+	Value *ypred = MLP_build(mlp, x, va)[0];
+	Value *loss = VA_powConst(va, VA_sub(va, ypred, y), VA_const(va, 2));
+
+	// samples
+	const int xs_n = 4;
+	const double xs[][3] = {{2, 3, -1}, {3, -1, 0.5}, {0.5, 1, 1}, {1, 1, -1}};
+	const double ys[] = {1, -1, -1, 1};
+
+	Topo *topo = Topo_new(loss);
+	Value *inputs[] = {x[0], x[1], x[2], y};
+	Tape *tape = Tape_compileBatch(topo, xs_n, inputs, 4);
+	const int i_x[] = {Tape_find(tape, x[0]), Tape_find(tape, x[1]), Tape_find(tape, x[2])};
+	const int i_y = Tape_find(tape, y);
+	const int i_ypred = Tape_find(tape, ypred);
+	const int i_loss = Tape_find(tape, loss);
 
 	// trains network
 	double st = Os_time();
 	const int kkN = 20;
 	for (int kk = 0; kk < kkN; kk++)
 	{
-		// forward pass
+		Tape_load(tape); // weights
 		for (int j = 0; j < xs_n; j++)
-			TopoMT_run(topoParalel, topoMLP[j]); // Topo_run(topoMLP[j]);
+		{
+			for (int i = 0; i < 3; i++)
+				Tape_setData(tape, i_x[i], j, xs[j][i]);
+			Tape_setData(tape, i_y, j, ys[j]);
+		}
 
-		// backward pass
-		TopoMT_run(topoParalel, topoLoss); // Topo_run(topoLoss);
+		Tape_run(tape);
+		Tape_store(tape); // grads are summed over lanes
 
 		// update
-		for (int j = 0; j < xs_n; j++)
-			Topo_update(topoMLP[j], -0.05); //-
+		ParamStore_update(mlp->params, -0.05); //-
 
-		printf("[%d] ret: %f\n", kk, loss->data);
+		double sum = 0;
+		for (int j = 0; j < xs_n; j++)
+			sum += Tape_getData(tape, i_loss, j);
+		printf("[%d] ret: %f\n", kk, sum);
 	}
 
 	for (int j = 0; j < xs_n; j++)
-		printf("ypred: %f\n", ypred[j]->data);
+		printf("ypred: %f\n", Tape_getData(tape, i_ypred, j));
 
 	printf("Trained in %fs\n", Os_time() - st);
 
-	// cleaning
-	TopoMT_delete(topoParalel);
-	Topo_delete(topoLoss);
+	Tape_delete(tape);
+	Topo_delete(topo);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+}
+
+void example8(void)
+{
+	ValueAllocator *va = ValueAllocator_new();
+
+	Value *x[] = {VA_const(va, 2.0), VA_const(va, 3.0), VA_const(va, -1.0)};
+	const int ioSizes[] = {4, 4, 1};
+
+	// saves random MLP and loads it back
+	MLP *mlp = MLP_new(3, ioSizes, 3);
+	const char *path = "mlp_example8.bin";
+	if (!MLP_save(mlp, path))
+		printf("Saving %s failed\n", path);
+
+	double st = Os_time();
+	MLP *mlp2 = MLP_load(path);
+	printf("Loaded in %fs\n", Os_time() - st);
+	remove(path); // params are copied, file isn't needed
+	if (!mlp2)
+	{
+		printf("Loading %s failed\n", path);
+		MLP_delete(mlp);
+		ValueAllocator_delete(va);
+		return;
+	}
+
+	Value *ret = MLP_build(mlp, x, va)[0];
+	Value *ret2 = MLP_build(mlp2, x, va)[0];
+	Topo *topo = Topo_new(ret);
+	Topo *topo2 = Topo_new(ret2);
+	Topo_run(topo);
+	Topo_run(topo2);
+	printf("saved: %f | loaded: %f\n", ret->data, ret2->data);
+
+	Topo_delete(topo);
+	Topo_delete(topo2);
+	MLP_delete(mlp);
+	MLP_delete(mlp2);
+	ValueAllocator_delete(va);
+}
+
+void example9(void)
+{
+	// synthetic dataset: y = sin(x0) * x1
+	const int num_samples = 1024;
+	double *samples = malloc(num_samples * 3 * sizeof(double));
+	for (int j = 0; j < num_samples; j++)
+	{
+		samples[j * 3 + 0] = Std_random11() * 2;
+		samples[j * 3 + 1] = Std_random11();
+		samples[j * 3 + 2] = sin(samples[j * 3 + 0]) * samples[j * 3 + 1];
+	}
+	const char *path = "dataset_example9.bin";
+	char ok = Dataset_write(path, samples, num_samples, 2, 1);
+	free(samples);
+
+	const int batch = 16;
+	Dataset *ds = ok ? Dataset_open(path, batch) : 0;
+	remove(path); // mapping stays valid
+	if (!ds)
+	{
+		printf("Dataset %s failed\n", path);
+		return;
+	}
+
+	ValueAllocator *va = ValueAllocator_new();
+
+	// one graph for whole batch, dataset writes into x and y
+	Value *x[batch * 2];
+	Value *y[batch];
+	for (int i = 0; i < batch * 2; i++)
+		x[i] = VA_const(va, 0);
+	for (int j = 0; j < batch; j++)
+		y[j] = VA_const(va, 0);
+
+	const int ioSizes[] = {16, 16, 1};
+	MLP *mlp = MLP_new(2, ioSizes, 3);
+	Optim *optim = Optim_newAdam(mlp->params, 0.01, 0.9, 0.999, 1e-8, 0);
+
+	Value *pws[batch];
+	for (int j = 0; j < batch; j++)
+	{
+		Value *ypred = MLP_build(mlp, &x[j * 2], va)[0];
+		pws[j] = VA_powConst(va, VA_sub(va, ypred, y[j]), VA_const(va, 2));
+	}
+	Value *loss = VA_mul(va, VA_sum(va, pws, batch), VA_const(va, 1.0 / batch));
+	Topo *topo = Topo_new(loss);
+
+	// trains network
+	double st = Os_time();
+	double wait = 0;
+	const int steps_per_epoch = num_samples / batch;
+	for (int e = 0; e < 10; e++)
+	{
+		double sum = 0;
+		for (int s = 0; s < steps_per_epoch; s++)
+		{
+			double stw = Os_time();
+			Dataset_next(ds, x, y);
+			wait += Os_time() - stw;
+
+			Topo_run(topo);
+			Optim_step(optim);
+			sum += loss->data;
+		}
+		printf("[epoch %d] loss: %f\n", e, sum / steps_per_epoch);
+	}
+	printf("Trained in %fs, waited for data %fs\n", Os_time() - st, wait);
+
+	Topo_delete(topo);
+	Optim_delete(optim);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+	Dataset_delete(ds);
+}
+
+void example10(void)
+{
+	ValueAllocator *va = ValueAllocator_new();
+
+	Value *x[32];
+	for (int i = 0; i < 32; i++)
+		x[i] = VA_const(va, Std_random11());
+
+	const int ioSizes[] = {32, 32, 32, 1};
+	MLP *mlp = MLP_new(32, ioSizes, 4);
+	Value *ret = MLP_build(mlp, x, va)[0];
+	Topo *topo = Topo_new(ret);
+
+	// reference
+	Topo_run(topo);
+	const double ref = ret->data;
+	ret->data = 0;
+
+	Infer *infer = Infer_new(topo, &ret, 1);
+	Infer_run(infer);
+	printf("topo: %f | infer: %f\n", ref, ret->data);
+	printf("computed nodes: %d, slots: %d\n", infer->num_nodes, infer->num_slots);
+
+	double st = Os_time();
+	for (int i = 0; i < 1000; i++)
+		Topo_run(topo);
+	printf("Topo_run: %fms\n", (Os_time() - st) * 1000 / 1000);
+
+	st = Os_time();
+	for (int i = 0; i < 1000; i++)
+		Infer_run(infer);
+	printf("Infer_run: %fms\n", (Os_time() - st) * 1000 / 1000);
+
+	Infer_delete(infer);
+	Topo_delete(topo);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+}
+
+void example11(void)
+{
+	ValueAllocator *va = ValueAllocator_new();
+
+	// deep and narrow MLP, batch of samples shares weights
+	const int mb = 16;
+	Value *x[mb][8];
+	for (int j = 0; j < mb; j++)
+		for (int i = 0; i < 8; i++)
+			x[j][i] = VA_const(va, Std_random11());
+	const ValueAllocatorMark mark = ValueAllocator_mark(va); // graph starts here
+
+	int ioSizes[17];
+	for (int i = 0; i < 16; i++)
+		ioSizes[i] = 8;
+	ioSizes[16] = 1;
+	MLP *mlp = MLP_new(8, ioSizes, 17);
+	Value *y[mb];
+	for (int j = 0; j < mb; j++)
+		y[j] = MLP_build(mlp, x[j], va)[0];
+	Topo *topo = Topo_newMulti(y, mb);
+
+	// reference
+	Topo_run(topo);
+	double y_ref[mb];
+	for (int j = 0; j < mb; j++)
+		y_ref[j] = y[j]->data;
+	double *grads = malloc(mlp->params->num_values * sizeof(double));
+	for (int i = 0; i < mlp->params->num_values; i++)
+		grads[i] = mlp->params->values[i].grad;
+
+	// computed Values with operands take ~500KB, they are released then. Program takes most of budget
+	const size_t budget = 256 * 1024;
+	Remat *remat = Remat_new(topo, budget);
+	Remat_print(remat);
+	Topo_delete(topo);
+	ValueAllocator_release(va, mark);
+
+	Remat_load(remat);
+	Remat_run(remat);
+	Remat_store(remat);
+
+	double maxDiff = 0;
+	for (int i = 0; i < mlp->params->num_values; i++)
+		maxDiff = fmax(maxDiff, fabs(mlp->params->values[i].grad - grads[i]));
+	double maxOut = 0;
+	for (int j = 0; j < mb; j++)
+		maxOut = fmax(maxOut, fabs(Remat_output(remat, j) - y_ref[j]));
+	printf("max output error: %g, max grad error: %g\n", maxOut, maxDiff);
+
+	free(grads);
+	Remat_delete(remat);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+}
+
+void example12(void)
+{
+	// small blocks with huge pages, graph is rebuilt every step
+	ValueAllocator *va = ValueAllocator_newConfig(4096, 1);
+
+	const int ioSizes[] = {16, 16, 1};
+	MLP *mlp = MLP_new(4, ioSizes, 3);
+	Optim *optim = Optim_newAdam(mlp->params, 0.01, 0.9, 0.999, 1e-8, 0);
+
+	// inputs and targets outlive steps
+	Value *x[4];
+	for (int i = 0; i < 4; i++)
+		x[i] = VA_const(va, 0);
+	Value *y = VA_const(va, 0);
+	Value *two = VA_const(va, 2);
+	const ValueAllocatorMark mark = ValueAllocator_mark(va);
+
+	double st = Os_time();
+	const int kkN = 1000;
+	for (int kk = 0; kk < kkN; kk++)
+	{
+		// y = x0 * x1 - x2 + x3
+		for (int i = 0; i < 4; i++)
+			x[i]->data = Std_random11();
+		y->data = x[0]->data * x[1]->data - x[2]->data + x[3]->data;
+
+		// transient graph
+		Value *ypred = MLP_build(mlp, x, va)[0];
+		Value *loss = VA_powConst(va, VA_sub(va, ypred, y), two);
+		Topo *topo = Topo_new(loss);
+		Topo_run(topo);
+		Optim_step(optim);
+
+		if (kk % 250 == 0 || kk == kkN - 1)
+			printf("[%d] loss: %f, values: %d, blocks: %d\n", kk, loss->data, ValueAllocator_numValues(va), va->num_blocks);
+
+		Topo_delete(topo);
+		ValueAllocator_release(va, mark); // blocks stay warm for next step
+	}
+	printf("%d steps in %fs\n", kkN, Os_time() - st);
+
+	Optim_delete(optim);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+}
+
+void example13(void)
+{
+	ValueAllocator *va = ValueAllocator_new();
+
+	const int ioSizes[] = {32, 32, 1};
+	MLP *mlp = MLP_new(8, ioSizes, 3);
+
+	// microbatches, every one has own inputs and topo
+	const int num_mb = 8;
+	const int mb = 16;
+	Topo *topos[num_mb];
+	for (int m = 0; m < num_mb; m++)
+	{
+		Value *pws[mb];
+		for (int j = 0; j < mb; j++)
+		{
+			Value *x[8];
+			double y = 0;
+			for (int i = 0; i < 8; i++)
+			{
+				x[i] = VA_const(va, Std_random11());
+				y += x[i]->data / 8;
+			}
+			Value *sub = VA_sub(va, MLP_build(mlp, x, va)[0], VA_const(va, y));
+			pws[j] = VA_powConst(va, sub, VA_const(va, 2));
+		}
+		topos[m] = Topo_newMulti(pws, mb);
+	}
+
+	const int N = mlp->params->num_values;
+	double *grads = malloc(N * sizeof(double));
+	const int kkN = 20;
+
+	// sequential loop
+	TopoMT *mt = TopoMT_new(NUMBER_OF_THREADS);
+	double st = Os_timeMono();
+	for (int kk = 0; kk < kkN; kk++)
+	{
+		ParamStore_zeroGrads(mlp->params);
+		for (int m = 0; m < num_mb; m++)
+			TopoMT_runPhases(mt, topos[m], TopoMT_PHASE_FORWARD | TopoMT_PHASE_RESET_INNER | TopoMT_PHASE_BACKWARD);
+	}
+	const double time_seq = (Os_timeMono() - st) / kkN;
+	printf("Sequential(%d threads): wall %.3fms, %.0f samples/s\n", mt->num_threads, time_seq * 1000, num_mb * mb / time_seq);
+	for (int i = 0; i < N; i++)
+		grads[i] = mlp->params->values[i].grad;
+	TopoMT_delete(mt);
+
+	// pipelined
+	Pipe *pipe = Pipe_new(NUMBER_OF_THREADS);
+	for (int kk = 0; kk < kkN; kk++)
+	{
+		ParamStore_zeroGrads(mlp->params);
+		Pipe_run(pipe, topos, num_mb);
+	}
+	Pipe_print(pipe, mb);
+
+	double maxDiff = 0;
+	for (int i = 0; i < N; i++)
+		maxDiff = fmax(maxDiff, fabs(mlp->params->values[i].grad - grads[i]));
+	printf("max grad diff: %g\n", maxDiff);
+
+	Pipe_delete(pipe);
+	free(grads);
+	for (int m = 0; m < num_mb; m++)
+		Topo_delete(topos[m]);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+}
+
+void example14(void)
+{
+	ValueAllocator *va = ValueAllocator_new();
+
+	const int ioSizes[] = {32, 32, 1};
+	MLP *mlp = MLP_new(8, ioSizes, 3);
+
+	const int xs_n = 16;
+	Value *pws[xs_n];
+	for (int j = 0; j < xs_n; j++)
+	{
+		Value *x[8];
+		double y = 0;
+		for (int i = 0; i < 8; i++)
+		{
+			x[i] = VA_const(va, Std_random11());
+			y += x[i]->data / 8;
+		}
+		Value *sub = VA_sub(va, MLP_build(mlp, x, va)[0], VA_const(va, y));
+		pws[j] = VA_powConst(va, sub, VA_const(va, 2));
+	}
+	Topo *topo = Topo_newMulti(pws, xs_n);
+	Tape *tape = Tape_compile(topo);
+	Tape_load(tape);
+
+	Jit *jit = Jit_new(tape, 0);
+	if (!jit)
+	{
+		printf("no C compiler or cache directory isn't private, Tape_run() is used\n");
+		Tape_delete(tape);
+		Topo_delete(topo);
+		MLP_delete(mlp);
+		ValueAllocator_delete(va);
+		return;
+	}
+	printf("compiled %d nodes in %.3fs(cached: %d)\n", tape->num_nodes, jit->compile_s, jit->cached);
+
+	// same graph is only loaded from cache
+	Jit *jit2 = Jit_new(tape, 0);
+	printf("second load %.3fs(cached: %d)\n", jit2->compile_s, jit2->cached);
+	Jit_delete(jit2);
+
+	const int N = tape->num_nodes;
+	double *grads = malloc(N * sizeof(double));
+	Tape_run(tape);
+	for (int i = 0; i < N; i++)
+		grads[i] = tape->grad[i];
+
+	Jit_run(jit);
+	double maxDiff = 0;
+	for (int i = 0; i < N; i++)
+		maxDiff = fmax(maxDiff, fabs(tape->grad[i] - grads[i]));
+	printf("max grad diff: %g\n", maxDiff);
+
+	// best of interleaved runs
+	const int kkN = 200;
+	double time_tape = 1e9, time_jit = 1e9;
+	for (int r = 0; r < 5; r++)
+	{
+		double st = Os_timeMono();
+		for (int kk = 0; kk < kkN; kk++)
+			Tape_run(tape);
+		time_tape = fmin(time_tape, (Os_timeMono() - st) / kkN);
+
+		st = Os_timeMono();
+		for (int kk = 0; kk < kkN; kk++)
+			Jit_run(jit);
+		time_jit = fmin(time_jit, (Os_timeMono() - st) / kkN);
+	}
+	printf("tape: %.3fms, jit: %.3fms(%.2fx)\n", time_tape * 1000, time_jit * 1000, time_tape / time_jit);
+
+	Tape_store(tape);
+	free(grads);
+	Jit_delete(jit);
+	Tape_delete(tape);
+	Topo_delete(topo);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+}
+
+void example15(void)
+{
+	ValueAllocator *va = ValueAllocator_new();
+
+	const int num_inputs = 64;
+	const int ioSizes[] = {128, 128, 4};
+	MLP *mlp = MLP_new(num_inputs, ioSizes, 3);
+
+	const int batch = 32;
+	const int num_outputs = ioSizes[2];
+	Dense *dense = Dense_new(mlp, batch);
+	Dense_load(dense);
+
+	// same inputs for graph and dense
+	Value *x[batch * num_inputs];
+	Value *outs[batch * num_outputs];
+	for (int i = 0; i < batch * num_inputs; i++)
+	{
+		x[i] = VA_const(va, Std_random11());
+		dense->x[i] = x[i]->data;
+	}
+	for (int j = 0; j < batch; j++)
+	{
+		Value **y = MLP_build(mlp, &x[j * num_inputs], va);
+		for (int i = 0; i < num_outputs; i++)
+			outs[j * num_outputs + i] = y[i];
+	}
+	Topo *topo = Topo_newMulti(outs, batch * num_outputs); // every output gets grad 1
+
+	double *dy = malloc(batch * num_outputs * sizeof(double));
+	for (int i = 0; i < batch * num_outputs; i++)
+		dy[i] = 1;
+
+	const int N = mlp->params->num_values;
+	double *grads = malloc(N * sizeof(double));
+	Topo_run(topo);
+	for (int i = 0; i < N; i++)
+		grads[i] = mlp->params->values[i].grad;
+
+	Dense_forward(dense);
+	Dense_backward(dense, dy);
+	Dense_store(dense);
+
+	double maxDiff = 0;
+	for (int i = 0; i < batch * num_outputs; i++)
+		maxDiff = fmax(maxDiff, fabs(Dense_outputs(dense)[i] - outs[i]->data));
+	printf("max output diff: %g\n", maxDiff);
+	maxDiff = 0;
+	for (int i = 0; i < N; i++)
+		maxDiff = fmax(maxDiff, fabs(mlp->params->values[i].grad - grads[i]));
+	for (int i = 0; i < batch * num_inputs; i++)
+		maxDiff = fmax(maxDiff, fabs(dense->dx[i] - x[i]->grad));
+	printf("max grad diff: %g\n", maxDiff);
+
+	// best of interleaved runs
+	const int kkN = 10;
+	double time_topo = 1e9, time_dense = 1e9;
+	for (int r = 0; r < 3; r++)
+	{
+		double st = Os_timeMono();
+		for (int kk = 0; kk < kkN; kk++)
+			Topo_run(topo);
+		time_topo = fmin(time_topo, (Os_timeMono() - st) / kkN);
+
+		st = Os_timeMono();
+		for (int kk = 0; kk < kkN; kk++)
+		{
+			Dense_forward(dense);
+			Dense_backward(dense, dy);
+		}
+		time_dense = fmin(time_dense, (Os_timeMono() - st) / kkN);
+	}
+	printf("topo: %.3fms, dense: %.3fms(%.1fx)\n", time_topo * 1000, time_dense * 1000, time_topo / time_dense);
+
+	free(dy);
+	free(grads);
+	Dense_delete(dense);
+	Topo_delete(topo);
+	MLP_delete(mlp);
+	ValueAllocator_delete(va);
+}
+
+void example16(void)
+{
+	ValueAllocator *va = ValueAllocator_new();
+
+	const int ioSizes[] = {8, 8, 1};
+	MLP *mlp = MLP_new(3, ioSizes, 3);
+
+	// mean of squared errors, written naively: add chain, pow(x, 2), literal per sample, one sample twice
+	const int xs_n = 64;
+	Value *xs[xs_n][3];
 	for (int j = 0; j < xs_n; j++)
-		Topo_delete(topoMLP[j]);
+		for (int i = 0; i < 3; i++)
+			xs[j][i] = VA_const(va, Std_random11());
+
+	Value *loss = 0;
+	for (int j = 0; j < xs_n + 1; j++)
+	{
+		Value **x = xs[j % xs_n];
+		Value *ypred = MLP_build(mlp, x, va)[0];
+		Value *y = VA_literal(va, (x[0]->data + x[1]->data * x[2]->data) / 2);
+		Value *pw = VA_powConst(va, VA_sub(va, ypred, y), VA_const(va, 2));
+		loss = loss ? VA_add(va, loss, pw) : pw;
+	}
+	loss = VA_mul(va, loss, VA_div(va, VA_literal(va, 1), VA_literal(va, xs_n + 1)));
+
+	const int N = mlp->params->num_values;
+	double *grads = malloc(N * sizeof(double));
+
+	Topo *topo = Topo_new(loss);
+	Topo_run(topo);
+	const double loss_before = loss->data;
+	for (int i = 0; i < N; i++)
+		grads[i] = mlp->params->values[i].grad;
+
+	Value *opt;
+	OptimizeReport report = Optimize_graph(&loss, 1, &opt, va);
+	OptimizeReport_print(&report);
+
+	Topo *topoOpt = Topo_new(opt);
+	Topo_run(topoOpt);
+	double maxDiff = 0;
+	for (int i = 0; i < N; i++)
+		maxDiff = fmax(maxDiff, fabs(mlp->params->values[i].grad - grads[i]));
+	printf("loss: %f | %f, max grad diff: %g\n", loss_before, opt->data, maxDiff);
+
+	// best of interleaved runs
+	const int kkN = 200;
+	double time_topo = 1e9, time_opt = 1e9;
+	for (int r = 0; r < 5; r++)
+	{
+		double st = Os_timeMono();
+		for (int kk = 0; kk < kkN; kk++)
+			Topo_run(topo);
+		time_topo = fmin(time_topo, (Os_timeMono() - st) / kkN);
+
+		st = Os_timeMono();
+		for (int kk = 0; kk < kkN; kk++)
+			Topo_run(topoOpt);
+		time_opt = fmin(time_opt, (Os_timeMono() - st) / kkN);
+	}
+	printf("topo: %.3fms, optimized: %.3fms(%.2fx)\n", time_topo * 1000, time_opt * 1000, time_topo / time_opt);
+
+	free(grads);
+	Topo_delete(topoOpt);
+	Topo_delete(topo);
 	MLP_delete(mlp);
 	ValueAllocator_delete(va);
 }
@@ -0,0 +1,281 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Forward-only executor. There are no grads and computed nodes don't write into their Values.
+// Intermediate results live in slots, slot is recycled after last user of its node(like register allocation),
+// so # of slots follows width of graph instead of its size. Leaves(inputs, weights) are read straight from Value.data.
+
+typedef struct InferNode_s
+{
+	unsigned char op;
+	unsigned int num_args; // n-ary
+	double *out;
+	const double *a; // 1st operand
+	const double *b; // 2nd operand
+	const double **args; // n-ary: a[0..num_args) + b[0..num_args)(DOT), [0..num_args)(SUM)
+} InferNode;
+
+typedef struct Infer_s
+{
+	InferNode *nodes; // in execution order
+	int num_nodes;
+
+	double *slots;
+	int num_slots;
+
+	const double **args;
+
+	// results are copied into output Values
+	Value **outputs;
+	const double **output_ptrs;
+	int num_outputs;
+} Infer;
+
+// 'outputs' must be in topo, they keep their slots until end of run
+Infer *Infer_new(Topo *topo, Value **outputs, const int num_outputs)
+{
+	Infer *self = malloc(sizeof(Infer));
+
+	// counts computed nodes and n-ary operands
+	int n = 0;
+	int n_args = 0;
+	for (int i = 0; i < topo->num_layers; i++)
+	{
+		TopoLayer *layer = &topo->layers[i];
+		for (int ii = 0; ii < layer->num_values; ii++)
+		{
+			Value *v = layer->values[ii];
+			if (v->op == Value_OP_EMPTY)
+				continue;
+			if (v->op == Value_OP_DOT || v->op == Value_OP_SUM)
+			{
+				int num;
+				Value_getPrevs(v, &num);
+				n_args += num;
+			}
+			n++;
+		}
+	}
+	self->num_nodes = n;
+	self->nodes = malloc(Std_bmax(1, n) * sizeof(InferNode));
+	self->args = malloc(Std_bmax(1, n_args) * sizeof(double *));
+	Value **values = malloc(Std_bmax(1, n) * sizeof(Value *));
+	int *last_use = malloc(Std_bmax(1, n) * sizeof(int));
+	int *slot_of = malloc(Std_bmax(1, n) * sizeof(int));
+	int *free_slots = malloc(Std_bmax(1, n) * sizeof(int));
+
+	// computed node of Topo value, operands always sit in lower layers, so they are already numbered
+	Topo_buildIndex(topo);
+	int *node_of = malloc(Std_bmax(1, Topo_numParameters(topo)) * sizeof(int));
+#define Infer_NODE(V) node_of[Topo_indexOf(topo, (V))]
+
+	// last use of node is its latest user
+	n = 0;
+	for (int i = 0; i < topo->num_layers; i++)
+	{
+		TopoLayer *layer = &topo->layers[i];
+		for (int ii = 0; ii < layer->num_values; ii++)
+		{
+			Value *v = layer->values[ii];
+			node_of[layer->first + ii] = -1;
+			if (v->op == Value_OP_EMPTY)
+				continue;
+
+			int num;
+			Value **prevs = Value_getPrevs(v, &num);
+			for (int p = 0; p < num; p++)
+				if (prevs[p] && prevs[p]->op != Value_OP_EMPTY)
+					last_use[Infer_NODE(prevs[p])] = n;
+
+			values[n] = v;
+			last_use[n] = n;
+			node_of[layer->first + ii] = n;
+			n++;
+		}
+	}
+	for (int i = 0; i < num_outputs; i++)
+		if (outputs[i]->op != Value_OP_EMPTY)
+			last_use[Infer_NODE(outputs[i])] = self->num_nodes; // never released
+
+	// assigns slots in execution order
+	int num_free = 0;
+	self->num_slots = 0;
+	for (int i = 0; i < self->num_nodes; i++)
+	{
+		slot_of[i] = num_free ? free_slots[--num_free] : self->num_slots++;
+
+		// operands which aren't needed anymore. Output gets slot first, so it never overlaps with its operands
+		int num;
+		Value **prevs = Value_getPrevs(values[i], &num);
+		for (int p = 0; p < num; p++)
+		{
+			if (prevs[p] && prevs[p]->op != Value_OP_EMPTY && last_use[Infer_NODE(prevs[p])] == i)
+			{
+				free_slots[num_free++] = slot_of[Infer_NODE(prevs[p])];
+				last_use[Infer_NODE(prevs[p])] = -1; // operand can be used more times by same node
+			}
+		}
+
+		// result which nobody reads
+		if (last_use[i] == i)
+			free_slots[num_free++] = slot_of[i];
+	}
+	self->slots = malloc(Std_bmax(1, self->num_slots) * sizeof(double));
+	memset(self->slots, 0, Std_bmax(1, self->num_slots) * sizeof(double));
+
+	// binds operands to slots or Value.data
+#define Infer_PTR(V) (((V)->op == Value_OP_EMPTY) ? &(V)->data : &self->slots[slot_of[Infer_NODE(V)]])
+	n_args = 0;
+	for (int i = 0; i < self->num_nodes; i++)
+	{
+		Value *v = values[i];
+		InferNode *node = &self->nodes[i];
+		node->op = v->op;
+		node->out = &self->slots[slot_of[i]];
+		node->a = node->b = 0;
+		node->args = 0;
+		node->num_args = 0;
+
+		if (v->op == Value_OP_DOT || v->op == Value_OP_SUM)
+		{
+			int num;
+			Value **prevs = Value_getPrevs(v, &num);
+			node->args = &self->args[n_args];
+			node->num_args = v->num_args;
+			for (int p = 0; p < num; p++)
+				self->args[n_args++] = Infer_PTR(prevs[p]);
+		}
+		else
+		{
+			if (v->prevs[0])
+				node->a = Infer_PTR(v->prevs[0]);
+			if (v->prevs[1])
+				node->b = Infer_PTR(v->prevs[1]);
+		}
+	}
+
+	self->num_outputs = num_outputs;
+	self->outputs = malloc(Std_bmax(1, num_outputs) * sizeof(Value *));
+	self->output_ptrs = malloc(Std_bmax(1, num_outputs) * sizeof(double *));
+	for (int i = 0; i < num_outputs; i++)
+	{
+		self->outputs[i] = outputs[i];
+		self->output_ptrs[i] = Infer_PTR(outputs[i]);
+	}
+#undef Infer_PTR
+#undef Infer_NODE
+
+	free(node_of);
+	free(values);
+	free(last_use);
+	free(slot_of);
+	free(free_slots);
+	return self;
+}
+
+void Infer_delete(Infer *self)
+{
+	free(self->nodes);
+	free(self->slots);
+	free(self->args);
+	free(self->outputs);
+	free(self->output_ptrs);
+
+	memset(self, 0, sizeof(Infer));
+	free(self);
+}
+
+double _Infer_dot(const double **a, const double **b, const unsigned int n)
+{
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	unsigned int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		s0 += *a[i + 0] * *b[i + 0];
+		s1 += *a[i + 1] * *b[i + 1];
+		s2 += *a[i + 2] * *b[i + 2];
+		s3 += *a[i + 3] * *b[i + 3];
+	}
+	for (; i < n; i++)
+		s0 += *a[i] * *b[i];
+	return (s0 + s1) + (s2 + s3);
+}
+
+double _Infer_sum(const double **a, const unsigned int n)
+{
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	unsigned int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		s0 += *a[i + 0];
+		s1 += *a[i + 1];
+		s2 += *a[i + 2];
+		s3 += *a[i + 3];
+	}
+	for (; i < n; i++)
+		s0 += *a[i];
+	return (s0 + s1) + (s2 + s3);
+}
+
+// computes outputs from current leaves(Value.data) and writes them into output Values
+void Infer_run(Infer *self)
+{
+	for (int i = 0; i < self->num_nodes; i++)
+	{
+		const InferNode *node = &self->nodes[i];
+		switch (node->op)
+		{
+		case Value_OP_ADD:
+			*node->out = *node->a + *node->b;
+			break;
+		case Value_OP_SUB:
+			*node->out = *node->a - *node->b;
+			break;
+		case Value_OP_MUL:
+			*node->out = *node->a * *node->b;
+			break;
+		case Value_OP_DIV:
+			*node->out = *node->a / *node->b;
+			break;
+		case Value_OP_POW_CONST:
+			*node->out = pow(*node->a, *node->b);
+			break;
+		case Value_OP_NEG:
+			*node->out = *node->a * -1;
+			break;
+		case Value_OP_TANH:
+		{
+			const double ex = exp(2 * *node->a);
+			*node->out = (ex - 1) / (ex + 1);
+			break;
+		}
+		case Value_OP_RELU:
+			*node->out = (*node->a < 0) ? 0.0 : *node->a;
+			break;
+		case Value_OP_DOT:
+			*node->out = _Infer_dot(node->args, node->args + node->num_args, node->num_args);
+			break;
+		case Value_OP_SUM:
+			*node->out = _Infer_sum(node->args, node->num_args);
+			break;
+		default:
+			break;
+		}
+	}
+
+	for (int i = 0; i < self->num_outputs; i++)
+		self->outputs[i]->data = *self->output_ptrs[i];
+}
@@ -0,0 +1,382 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// JIT for Tape(batch 1). Every node becomes one C statement with constant indices, DOT/SUM loop over operand ranges
+// (contiguous ranges directly, others through index table). Code is compiled by system compiler('CC' or cc) into shared library,
+// which is loaded with dlopen(). Libraries are cached by hash of graph, so next run of same graph only loads it.
+// Data and grads stay in Tape, so Tape_load()/Tape_store() work as before.
+
+#define Jit_FUNC_NODES 64 // nodes per generated function, compile time grows fast with function size
+#define Jit_CFLAGS "-O2 -march=native -shared -fPIC"
+
+typedef void (*Jit_forwardFUNC)(double *d);
+typedef void (*Jit_backwardFUNC)(const double *d, double *g);
+
+typedef struct Jit_s
+{
+	Tape *tape;
+
+	void *lib;
+	Jit_forwardFUNC forward;
+	Jit_backwardFUNC backward;
+
+	unsigned long long hash;
+	char cached;	  // library was in cache
+	double compile_s; // generating + compiling + loading
+} Jit;
+
+unsigned long long _Jit_hash(unsigned long long h, const void *data, const size_t bytes)
+{
+	// FNV-1a
+	const unsigned char *p = data;
+	for (size_t i = 0; i < bytes; i++)
+		h = (h ^ p[i]) * 1099511628211ULL;
+	return h;
+}
+
+// first 'model name' and 'flags' lines of /proc/cpuinfo, -march=native output is only valid for this CPU
+unsigned long long _Jit_hashCpu(unsigned long long h)
+{
+	FILE *f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return h;
+
+	char line[4096];
+	int found = 0;
+	while (found < 2 && fgets(line, sizeof(line), f))
+		if (strncmp(line, "model name", 10) == 0 || strncmp(line, "flags", 5) == 0)
+		{
+			h = _Jit_hash(h, line, strlen(line));
+			found++;
+		}
+	fclose(f);
+	return h;
+}
+
+unsigned long long _Jit_hashTape(const Tape *tape, const char *cc)
+{
+	unsigned long long h = _Jit_hash(14695981039346656037ULL, "cmgjit1", 7); // format version
+	h = _Jit_hash(h, cc, strlen(cc) + 1);
+	h = _Jit_hash(h, Jit_CFLAGS, sizeof(Jit_CFLAGS));
+	h = _Jit_hashCpu(h);
+	h = _Jit_hash(h, &tape->num_nodes, sizeof(int));
+	h = _Jit_hash(h, tape->ops, tape->num_nodes);
+	h = _Jit_hash(h, tape->a, tape->num_nodes * sizeof(unsigned int));
+	h = _Jit_hash(h, tape->b, tape->num_nodes * sizeof(unsigned int));
+	h = _Jit_hash(h, tape->args, tape->num_args * sizeof(unsigned int));
+	h = _Jit_hash(h, &tape->num_roots, sizeof(int));
+	h = _Jit_hash(h, tape->roots, tape->num_roots * sizeof(unsigned int));
+	return h;
+}
+
+// 1 = indices are st, st+1, .., st+n-1
+char _Jit_isRange(const unsigned int *idx, const int n)
+{
+	for (int i = 1; i < n; i++)
+		if (idx[i] != idx[0] + i)
+			return 0;
+	return 1;
+}
+
+void _Jit_emitForward(FILE *f, const Tape *tape, const int i)
+{
+	const unsigned int a = tape->a[i], b = tape->b[i];
+	switch (tape->ops[i])
+	{
+	case Value_OP_ADD:
+		fprintf(f, "\td[%d] = d[%u] + d[%u];\n", i, a, b);
+		break;
+	case Value_OP_SUB:
+		fprintf(f, "\td[%d] = d[%u] - d[%u];\n", i, a, b);
+		break;
+	case Value_OP_MUL:
+		fprintf(f, "\td[%d] = d[%u] * d[%u];\n", i, a, b);
+		break;
+	case Value_OP_DIV:
+		fprintf(f, "\td[%d] = d[%u] / d[%u];\n", i, a, b);
+		break;
+	case Value_OP_POW_CONST:
+		fprintf(f, "\td[%d] = pow(d[%u], d[%u]);\n", i, a, b);
+		break;
+	case Value_OP_NEG:
+		fprintf(f, "\td[%d] = d[%u] * -1;\n", i, a);
+		break;
+	case Value_OP_TANH:
+		fprintf(f, "\t{ const double ex = exp(2 * d[%u]); d[%d] = (ex - 1) / (ex + 1); }\n", a, i);
+		break;
+	case Value_OP_RELU:
+		fprintf(f, "\td[%d] = (d[%u] < 0) ? 0.0 : d[%u];\n", i, a, a);
+		break;
+	case Value_OP_DOT:
+	{
+		const unsigned int *args = &tape->args[a];
+		if (_Jit_isRange(args, b) && _Jit_isRange(args + b, b))
+			fprintf(f, "\td[%d] = dot(d + %u, d + %u, %u);\n", i, args[0], args[b], b);
+		else
+			fprintf(f, "\td[%d] = dotIdx(d, T + %u, T + %u, %u);\n", i, a, a + b, b);
+		break;
+	}
+	case Value_OP_SUM:
+	{
+		const unsigned int *args = &tape->args[a];
+		if (_Jit_isRange(args, b))
+			fprintf(f, "\td[%d] = sum(d + %u, %u);\n", i, args[0], b);
+		else
+			fprintf(f, "\td[%d] = sumIdx(d, T + %u, %u);\n", i, a, b);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void _Jit_emitBackward(FILE *f, const Tape *tape, const int i)
+{
+	const unsigned int a = tape->a[i], b = tape->b[i];
+	switch (tape->ops[i])
+	{
+	case Value_OP_ADD:
+		fprintf(f, "\tg[%u] += g[%d]; g[%u] += g[%d];\n", a, i, b, i);
+		break;
+	case Value_OP_SUB:
+		fprintf(f, "\tg[%u] += g[%d]; g[%u] -= g[%d];\n", a, i, b, i);
+		break;
+	case Value_OP_MUL:
+		fprintf(f, "\tg[%u] += d[%u] * g[%d]; g[%u] += d[%u] * g[%d];\n", a, b, i, b, a, i);
+		break;
+	case Value_OP_DIV:
+		fprintf(f, "\tg[%u] += (1.0 / d[%u]) * g[%d]; g[%u] -= (d[%u] / (d[%u] * d[%u])) * g[%d];\n", a, b, i, b, a, b, b, i);
+		break;
+	case Value_OP_POW_CONST:
+		fprintf(f, "\tg[%u] += d[%u] * pow(d[%u], d[%u] - 1) * g[%d];\n", a, b, a, b, i);
+		break;
+	case Value_OP_NEG:
+		fprintf(f, "\tg[%u] -= g[%d];\n", a, i);
+		break;
+	case Value_OP_TANH:
+		fprintf(f, "\tg[%u] += (1 - (d[%d] * d[%d])) * g[%d];\n", a, i, i, i);
+		break;
+	case Value_OP_RELU:
+		fprintf(f, "\tg[%u] += (d[%d] > 0.0) * g[%d];\n", a, i, i);
+		break;
+	case Value_OP_DOT:
+	{
+		const unsigned int *args = &tape->args[a];
+		if (_Jit_isRange(args, b) && _Jit_isRange(args + b, b))
+			fprintf(f, "\tdotGrad(d, g, %u, %u, %u, g[%d]);\n", args[0], args[b], b, i);
+		else
+			fprintf(f, "\tdotGradIdx(d, g, T + %u, T + %u, %u, g[%d]);\n", a, a + b, b, i);
+		break;
+	}
+	case Value_OP_SUM:
+	{
+		const unsigned int *args = &tape->args[a];
+		if (_Jit_isRange(args, b))
+			fprintf(f, "\tfor (unsigned int k = 0; k < %u; k++) g[%u + k] += g[%d];\n", b, args[0], i);
+		else
+			fprintf(f, "\tfor (unsigned int k = 0; k < %u; k++) g[T[%u + k]] += g[%d];\n", b, a, i);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+// helpers sum in same order as _Value_dot()/_Value_sum(), so results are same as interpreter
+const char *_Jit_PRELUDE =
+	"#include <math.h>\n"
+	"static double dot(const double *a, const double *b, const unsigned int n)\n"
+	"{ double s0 = 0, s1 = 0, s2 = 0, s3 = 0; unsigned int i = 0;\n"
+	"  for (; i + 4 <= n; i += 4) { s0 += a[i] * b[i]; s1 += a[i + 1] * b[i + 1]; s2 += a[i + 2] * b[i + 2]; s3 += a[i + 3] * b[i + 3]; }\n"
+	"  for (; i < n; i++) s0 += a[i] * b[i];\n"
+	"  return (s0 + s1) + (s2 + s3); }\n"
+	"static double dotIdx(const double *d, const unsigned int *a, const unsigned int *b, const unsigned int n)\n"
+	"{ double s0 = 0, s1 = 0, s2 = 0, s3 = 0; unsigned int i = 0;\n"
+	"  for (; i + 4 <= n; i += 4) { s0 += d[a[i]] * d[b[i]]; s1 += d[a[i + 1]] * d[b[i + 1]]; s2 += d[a[i + 2]] * d[b[i + 2]]; s3 += d[a[i + 3]] * d[b[i + 3]]; }\n"
+	"  for (; i < n; i++) s0 += d[a[i]] * d[b[i]];\n"
+	"  return (s0 + s1) + (s2 + s3); }\n"
+	"static double sum(const double *a, const unsigned int n)\n"
+	"{ double s0 = 0, s1 = 0, s2 = 0, s3 = 0; unsigned int i = 0;\n"
+	"  for (; i + 4 <= n; i += 4) { s0 += a[i]; s1 += a[i + 1]; s2 += a[i + 2]; s3 += a[i + 3]; }\n"
+	"  for (; i < n; i++) s0 += a[i];\n"
+	"  return (s0 + s1) + (s2 + s3); }\n"
+	"static double sumIdx(const double *d, const unsigned int *a, const unsigned int n)\n"
+	"{ double s0 = 0, s1 = 0, s2 = 0, s3 = 0; unsigned int i = 0;\n"
+	"  for (; i + 4 <= n; i += 4) { s0 += d[a[i]]; s1 += d[a[i + 1]]; s2 += d[a[i + 2]]; s3 += d[a[i + 3]]; }\n"
+	"  for (; i < n; i++) s0 += d[a[i]];\n"
+	"  return (s0 + s1) + (s2 + s3); }\n"
+	"static void dotGrad(const double *d, double *g, const unsigned int a, const unsigned int b, const unsigned int n, const double gi)\n"
+	"{ for (unsigned int k = 0; k < n; k++) { g[a + k] += d[b + k] * gi; g[b + k] += d[a + k] * gi; } }\n"
+	"static void dotGradIdx(const double *d, double *g, const unsigned int *a, const unsigned int *b, const unsigned int n, const double gi)\n"
+	"{ for (unsigned int k = 0; k < n; k++) { g[a[k]] += d[b[k]] * gi; g[b[k]] += d[a[k]] * gi; } }\n";
+
+char _Jit_writeSource(const Tape *tape, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return 0;
+
+	fprintf(f, "%s", _Jit_PRELUDE);
+
+	// operands of n-ary nodes
+	fprintf(f, "static const unsigned int T[%d] = {", Std_bmax(1, tape->num_args));
+	for (int i = 0; i < tape->num_args; i++)
+		fprintf(f, "%s%s%u", i ? "," : "", (i % 32) ? "" : "\n", tape->args[i]);
+	fprintf(f, "%s};\n", tape->num_args ? "" : "0");
+
+	const int first = (tape->num_layers > 1) ? tape->layers[1] : tape->num_nodes; // leaves are skipped
+	const int num_funcs = (tape->num_nodes - first + Jit_FUNC_NODES - 1) / Jit_FUNC_NODES;
+
+	for (int fn = 0; fn < num_funcs; fn++)
+	{
+		const int st = first + fn * Jit_FUNC_NODES;
+		const int en = Std_bmin(tape->num_nodes, st + Jit_FUNC_NODES);
+
+		fprintf(f, "static void forward%d(double *restrict d)\n{\n", fn);
+		for (int i = st; i < en; i++)
+			_Jit_emitForward(f, tape, i);
+		fprintf(f, "}\n");
+
+		fprintf(f, "static void backward%d(const double *restrict d, double *restrict g)\n{\n", fn);
+		for (int i = en - 1; i >= st; i--)
+			_Jit_emitBackward(f, tape, i);
+		fprintf(f, "}\n");
+	}
+
+	fprintf(f, "void cmg_forward(double *d)\n{\n");
+	for (int fn = 0; fn < num_funcs; fn++)
+		fprintf(f, "\tforward%d(d);\n", fn);
+	fprintf(f, "}\n");
+
+	fprintf(f, "void cmg_backward(const double *d, double *g)\n{\n");
+	for (int fn = num_funcs - 1; fn >= 0; fn--)
+		fprintf(f, "\tbackward%d(d, g);\n", fn);
+	fprintf(f, "}\n");
+
+	return fclose(f) == 0;
+}
+
+// 'path' isn't symlink, is owned by effective user and only owner can write into it
+char _Jit_isPrivate(const char *path, const char dir)
+{
+	struct stat st;
+	if (lstat(path, &st) != 0)
+		return 0;
+	return (dir ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode)) && st.st_uid == geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+// compiles 'tape'(batch 1) or loads it from 'cache_dir'(0 = $XDG_CACHE_HOME/cmicrograd_jit or /tmp/cmicrograd_jit-<uid>).
+// Directory must belong to effective user and mustn't be writable by others, library is loaded only from such directory.
+// Returns 0 when there is no compiler or directory isn't private, then use Tape_run()
+Jit *Jit_new(Tape *tape, const char *cache_dir)
+{
+	if (tape->batch != 1)
+		return 0; // lanes aren't generated
+
+	const double st = Os_timeMono();
+	char dir[512];
+	if (!cache_dir)
+	{
+		const char *xdg = getenv("XDG_CACHE_HOME");
+		if (xdg && xdg[0] == '/')
+		{
+			mkdir(xdg, 0700);
+			snprintf(dir, sizeof(dir), "%s/cmicrograd_jit", xdg);
+		}
+		else
+			snprintf(dir, sizeof(dir), "/tmp/cmicrograd_jit-%u", (unsigned int)geteuid());
+		cache_dir = dir;
+	}
+	if (strlen(cache_dir) >= sizeof(dir) || strchr(cache_dir, '\'')) // paths are quoted in command
+		return 0;
+	mkdir(cache_dir, 0700);
+	if (!_Jit_isPrivate(cache_dir, 1))
+		return 0; // other user could place library there
+
+	const char *cc = getenv("CC");
+	cc = cc ? cc : "cc";
+
+	const unsigned long long hash = _Jit_hashTape(tape, cc);
+	char lib_path[1024], src_path[1024], tmp_path[1024], cmd[4096];
+	snprintf(lib_path, sizeof(lib_path), "%s/cmg_%016llx.so", cache_dir, hash);
+
+	char cached = _Jit_isPrivate(lib_path, 0);
+	if (!cached)
+	{
+		// unique temporary names, so two processes can compile same graph
+		snprintf(src_path, sizeof(src_path), "%s/cmg_%016llx_%d.c", cache_dir, hash, (int)getpid());
+		snprintf(tmp_path, sizeof(tmp_path), "%s/cmg_%016llx_%d.so", cache_dir, hash, (int)getpid());
+		if (!_Jit_writeSource(tape, src_path))
+			return 0;
+
+		snprintf(cmd, sizeof(cmd), "%s " Jit_CFLAGS " -o '%s' '%s' -lm", cc, tmp_path, src_path);
+		const int ret = system(cmd);
+		remove(src_path);
+		if (ret != 0 || rename(tmp_path, lib_path) != 0 || !_Jit_isPrivate(lib_path, 0))
+		{
+			remove(tmp_path);
+			return 0;
+		}
+	}
+
+	void *lib = dlopen(lib_path, RTLD_NOW | RTLD_LOCAL);
+	Jit_forwardFUNC forward = lib ? (Jit_forwardFUNC)dlsym(lib, "cmg_forward") : 0;
+	Jit_backwardFUNC backward = lib ? (Jit_backwardFUNC)dlsym(lib, "cmg_backward") : 0;
+	if (!forward || !backward)
+	{
+		if (lib)
+			dlclose(lib);
+		return 0;
+	}
+
+	Jit *self = malloc(sizeof(Jit));
+	self->tape = tape;
+	self->lib = lib;
+	self->forward = forward;
+	self->backward = backward;
+	self->hash = hash;
+	self->cached = cached;
+	self->compile_s = Os_timeMono() - st;
+	return self;
+}
+
+void Jit_delete(Jit *self)
+{
+	dlclose(self->lib);
+	memset(self, 0, sizeof(Jit));
+	free(self);
+}
+
+void Jit_forward(Jit *self)
+{
+	self->forward(self->tape->data);
+}
+
+// resets grads and propagates them from roots
+void Jit_backward(Jit *self)
+{
+	Tape_resetGrads(self->tape);
+	self->backward(self->tape->data, self->tape->grad);
+}
+
+void Jit_run(Jit *self)
+{
+	if (self->tape->num_layers == 0)
+		return;
+
+	Jit_forward(self);
+	Jit_backward(self);
+}
@@ -19,16 +19,43 @@ limitations under the License.
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
 #include <sys/random.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "std.h"
 #include "value.h"
+#include "param.h"
 #include "topo.h"
+#include "cost.h"
+#include "trace.h"
 #include "topo_mt.h"
+#include "pipe.h"
+#include "tape.h"
+#include "jit.h"
+#include "topo_df.h"
+#include "infer.h"
+#include "remat.h"
+#include "optimize.h"
+#include "optim.h"
+#include "perf.h"
 #include "mlp.h"
+#include "dense.h"
+#include "checkpoint.h"
+#include "dataset.h"
 
 #include "examples.h"
 
@@ -46,5 +73,41 @@ int main(int argc, char **argv)
 	printf("\n---Example 4---\n");
 	example4();
 
+	printf("\n---Example 5---\n");
+	example5();
+
+	printf("\n---Example 6---\n");
+	example6();
+
+	printf("\n---Example 7---\n");
+	example7();
+
+	printf("\n---Example 8---\n");
+	example8();
+
+	printf("\n---Example 9---\n");
+	example9();
+
+	printf("\n---Example 10---\n");
+	example10();
+
+	printf("\n---Example 11---\n");
+	example11();
+
+	printf("\n---Example 12---\n");
+	example12();
+
+	printf("\n---Example 13---\n");
+	example13();
+
+	printf("\n---Example 14---\n");
+	example14();
+
+	printf("\n---Example 15---\n");
+	example15();
+
+	printf("\n---Example 16---\n");
+	example16();
+
 	return 0;
 }
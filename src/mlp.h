@@ -17,31 +17,31 @@ limitations under the License.
 typedef struct Neuron_s
 {
 	int num_inputs;
-	Value **w;
-	Value *b;
+	Value **w; // num_inputs weights + bias, so bias is one more operand of dot
+	Value *b;  // w[num_inputs]
 } Neuron;
 
-void Neuron_init(Neuron *self, const int num_inputs, ValueAllocator *allocator)
+// binds weights and bias to 'params'(num_inputs + 1 Values)
+void Neuron_init(Neuron *self, const int num_inputs, Value *params)
 {
 	self->num_inputs = num_inputs;
-	self->w = malloc(self->num_inputs * sizeof(Value *));
-	for (int i = 0; i < self->num_inputs; i++)
-		self->w[i] = VA_const(allocator, Std_random11());
-	self->b = VA_const(allocator, Std_random11());
+	self->w = malloc((self->num_inputs + 1) * sizeof(Value *));
+	for (int i = 0; i <= self->num_inputs; i++)
+		self->w[i] = &params[i];
+	self->b = self->w[num_inputs];
 }
 
 void Neuron_free(Neuron *self)
 {
-	memset(self->w, 0, self->num_inputs * sizeof(Value *));
+	memset(self->w, 0, (self->num_inputs + 1) * sizeof(Value *));
 	free(self->w);
 }
 
+// 'x' has num_inputs + 1 Values, last one is 1(see Layer_build())
 Value *Neuron_build(Neuron *self, Value **x, ValueAllocator *allocator)
 {
-	// w * x + b
-	Value *act = self->b;
-	for (int i = 0; i < self->num_inputs; i++)
-		act = VA_add(allocator, act, VA_mul(allocator, self->w[i], x[i]));
+	// w * x + b * 1
+	Value *act = VA_dot(allocator, self->w, x, self->num_inputs + 1);
 
 	act = VA_tanh(allocator, act);
 	return act;
@@ -51,19 +51,14 @@ typedef struct Layer_s
 {
 	int num;
 	Neuron *neurons;
-	Value **outputs;
 } Layer;
 
-void Layer_init(Layer *self, const int num_inputs, const int num_outputs, ValueAllocator *allocator)
+void Layer_init(Layer *self, const int num_inputs, const int num_outputs, Value *params)
 {
 	self->num = num_outputs;
 	self->neurons = malloc(self->num * sizeof(Neuron));
-	self->outputs = malloc(self->num * sizeof(Value *));
 	for (int i = 0; i < self->num; i++)
-	{
-		Neuron_init(&self->neurons[i], num_inputs, allocator);
-		self->outputs[i] = 0;
-	}
+		Neuron_init(&self->neurons[i], num_inputs, &params[i * (num_inputs + 1)]);
 }
 
 void Layer_free(Layer *self)
@@ -72,41 +67,69 @@ void Layer_free(Layer *self)
 		Neuron_free(&self->neurons[i]);
 	memset(self->neurons, 0, self->num * sizeof(Neuron));
 	free(self->neurons);
-
-	memset(self->outputs, 0, self->num * sizeof(Value *));
-	free(self->outputs);
 }
 
+// outputs are allocated in 'allocator', so layer can be built for more samples at once
 Value **Layer_build(Layer *self, Value **x, ValueAllocator *allocator)
 {
+	// inputs + constant 1 for bias, shared by all neurons
+	const int num_in = self->num ? self->neurons[0].num_inputs : 0;
+	Value **xb = ValueAllocator_allocArgs(allocator, num_in + 1);
+	memcpy(xb, x, num_in * sizeof(Value *));
+	xb[num_in] = VA_literal(allocator, 1);
+
+	Value **outputs = ValueAllocator_allocArgs(allocator, self->num);
 	for (int i = 0; i < self->num; i++)
-		self->outputs[i] = Neuron_build(&self->neurons[i], x, allocator);
-	return self->outputs;
+		outputs[i] = Neuron_build(&self->neurons[i], xb, allocator);
+	return outputs;
 }
 
 typedef struct MLP_s
 {
 	int num_layers;
 	Layer *layers;
+	ParamStore *params; // weights and biases of all neurons
 } MLP;
 
-MLP *MLP_new(const int num_inputs, const int *outputs, const int num_outputs, ValueAllocator *allocator)
+int MLP_numParams(const int num_inputs, const int *outputs, const int num_outputs)
+{
+	// every neuron has weight per input + bias
+	int n = 0;
+	for (int i = 0; i < num_outputs; i++)
+		n += ((i ? outputs[i - 1] : num_inputs) + 1) * outputs[i];
+	return n;
+}
+
+// binds neurons to 'params', MLP takes ownership of them
+MLP *MLP_newParams(const int num_inputs, const int *outputs, const int num_outputs, ParamStore *params)
 {
 	MLP *self = malloc(sizeof(MLP));
 
 	self->num_layers = num_outputs;
 	self->layers = malloc(self->num_layers * sizeof(Layer));
+	self->params = params;
 
-	if (num_outputs)
+	int pos = 0;
+	for (int i = 0; i < self->num_layers; i++)
 	{
-		Layer_init(&self->layers[0], num_inputs, outputs[0], allocator); // 1st
-		for (int i = 1; i < self->num_layers; i++)						 // starts with 1
-			Layer_init(&self->layers[i], outputs[i - 1], outputs[i], allocator);
+		const int num_in = i ? outputs[i - 1] : num_inputs; // output of previous layer is input of next one
+		Layer_init(&self->layers[i], num_in, outputs[i], &params->values[pos]);
+		pos += (num_in + 1) * outputs[i];
 	}
 
 	return self;
 }
 
+MLP *MLP_new(const int num_inputs, const int *outputs, const int num_outputs)
+{
+	const int num_params = MLP_numParams(num_inputs, outputs, num_outputs);
+	ParamStore *params = ParamStore_new(num_params);
+	for (int i = 0; i < num_params; i++)
+		ParamStore_add(params, Std_random11());
+
+	return MLP_newParams(num_inputs, outputs, num_outputs, params);
+}
+
 void MLP_delete(MLP *self)
 {
 	for (int i = 0; i < self->num_layers; i++)
@@ -114,6 +137,8 @@ void MLP_delete(MLP *self)
 	memset(self->layers, 0, self->num_layers * sizeof(Layer));
 	free(self->layers);
 
+	ParamStore_delete(self->params);
+
 	memset(self, 0, sizeof(MLP));
 	free(self);
 }
@@ -124,3 +149,63 @@ Value **MLP_build(MLP *self, Value **x, ValueAllocator *allocator)
 		x = Layer_build(&self->layers[i], x, allocator); // output 'x' is use as input 'x' to another layer
 	return x;
 }
+
+typedef struct _MLP_buildJob_s
+{
+	StdThread thread;
+	MLP *mlp;
+	Value ***xs;
+	Value ***ys;
+	int st, en;
+	int cpu; // -1 = calling thread, isn't pinned
+	ValueAllocator *allocator;
+} _MLP_buildJob;
+
+StdThread_FUNC(_MLP_buildLoop, param)
+{
+	_MLP_buildJob *job = param;
+	if (job->cpu >= 0)
+		Std_pinThread(0, job->cpu); // blocks of child arena are first touched(placed) on this CPU's NUMA node
+	for (int j = job->st; j < job->en; j++)
+		job->ys[j] = MLP_build(job->mlp, job->xs[j], job->allocator);
+	return 0;
+}
+
+// builds MLP for 'n' samples, ys[j] = MLP_build(xs[j]). Every child of 'allocator' gets thread and range of samples,
+// without children it runs in calling thread. Params are only read, so samples don't touch each other
+void MLP_buildBatch(MLP *self, Value ***xs, Value ***ys, const int n, ValueAllocator *allocator)
+{
+	const int num_threads = Std_bmin(allocator->num_children, n);
+	if (num_threads <= 1)
+	{
+		for (int j = 0; j < n; j++)
+			ys[j] = MLP_build(self, xs[j], num_threads ? allocator->children[0] : allocator);
+		return;
+	}
+
+	_MLP_buildJob *jobs = malloc(num_threads * sizeof(_MLP_buildJob));
+	const int step = (n + num_threads - 1) / num_threads;
+	for (int i = 0; i < num_threads; i++)
+	{
+		_MLP_buildJob *job = &jobs[i];
+		job->mlp = self;
+		job->xs = xs;
+		job->ys = ys;
+		job->st = Std_bmin(n, step * i);
+		job->en = Std_bmin(n, step * (i + 1));
+		job->allocator = allocator->children[i];
+		job->cpu = i ? Std_cpuOfIndex(i) : -1;
+		if (i && !StdThread_init(&job->thread, "MLP_build", &_MLP_buildLoop, job))
+		{
+			job->cpu = -1;
+			_MLP_buildLoop(job); // no thread, builds it here
+		}
+	}
+
+	_MLP_buildLoop(&jobs[0]); // calling thread is one of workers
+	for (int i = 1; i < num_threads; i++)
+		StdThread_free(&jobs[i].thread);
+
+	memset(jobs, 0, num_threads * sizeof(_MLP_buildJob));
+	free(jobs);
+}
@@ -0,0 +1,176 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Optimizers over ParamStore. Every step is one fused pass which reads weight, grad and moments and writes weight and moments back.
+// Moments are contiguous arrays in same order as ParamStore. Weights and grads sit inside Values(40B stride), so step is memory bound
+// and SIMD gathers are slower than scalar loop.
+
+typedef enum
+{
+	Optim_SGD,	 // momentum SGD(momentum = 0 is plain SGD)
+	Optim_ADAM,	 // weight_decay is added to grad(L2)
+	Optim_ADAMW, // weight_decay is applied to weight directly(decoupled)
+} Optim_TYPE;
+
+typedef struct Optim_s
+{
+	Optim_TYPE type;
+	ParamStore *params;
+
+	double lr;
+	double momentum; // Optim_SGD
+	double beta1, beta2, eps;
+	double weight_decay;
+
+	double *m; // 1st moment(velocity for SGD)
+	double *v; // 2nd moment
+	int step;
+
+	// bias corrections of current step
+	double c1, c2;
+} Optim;
+
+Optim *_Optim_new(Optim_TYPE type, ParamStore *params, const double lr)
+{
+	Optim *self = malloc(sizeof(Optim));
+	memset(self, 0, sizeof(Optim));
+	self->type = type;
+	self->params = params;
+	self->lr = lr;
+
+	const int n = Std_bmax(1, params->num_values);
+	self->m = malloc(n * sizeof(double));
+	memset(self->m, 0, n * sizeof(double));
+	if (type != Optim_SGD)
+	{
+		self->v = malloc(n * sizeof(double));
+		memset(self->v, 0, n * sizeof(double));
+	}
+	return self;
+}
+
+Optim *Optim_newSGD(ParamStore *params, const double lr, const double momentum)
+{
+	Optim *self = _Optim_new(Optim_SGD, params, lr);
+	self->momentum = momentum;
+	return self;
+}
+
+Optim *Optim_newAdam(ParamStore *params, const double lr, const double beta1, const double beta2, const double eps, const double weight_decay)
+{
+	Optim *self = _Optim_new(Optim_ADAM, params, lr);
+	self->beta1 = beta1;
+	self->beta2 = beta2;
+	self->eps = eps;
+	self->weight_decay = weight_decay;
+	return self;
+}
+
+Optim *Optim_newAdamW(ParamStore *params, const double lr, const double beta1, const double beta2, const double eps, const double weight_decay)
+{
+	Optim *self = Optim_newAdam(params, lr, beta1, beta2, eps, weight_decay);
+	self->type = Optim_ADAMW;
+	return self;
+}
+
+void Optim_delete(Optim *self)
+{
+	free(self->m);
+	free(self->v);
+
+	memset(self, 0, sizeof(Optim));
+	free(self);
+}
+
+void _Optim_sgd(Optim *self, const int st, const int en)
+{
+	Value *restrict p = self->params->values;
+	double *restrict m = self->m;
+	const double lr = self->lr;
+	const double mu = self->momentum;
+
+	for (int i = st; i < en; i++)
+	{
+		m[i] = mu * m[i] + p[i].grad;
+		p[i].data -= lr * m[i];
+	}
+}
+
+void _Optim_adam(Optim *self, const int st, const int en)
+{
+	Value *restrict p = self->params->values;
+	double *restrict m = self->m;
+	double *restrict v = self->v;
+	const double lr = self->lr;
+	const double b1 = self->beta1;
+	const double b2 = self->beta2;
+	const double eps = self->eps;
+	const double c1 = self->c1;
+	const double c2 = self->c2;
+	const double l2 = (self->type == Optim_ADAM) ? self->weight_decay : 0;
+	const double decay = (self->type == Optim_ADAMW) ? (1 - lr * self->weight_decay) : 1;
+
+	for (int i = st; i < en; i++)
+	{
+		const double w = p[i].data;
+		const double g = p[i].grad + l2 * w;
+
+		const double mm = b1 * m[i] + (1 - b1) * g;
+		const double vv = b2 * v[i] + (1 - b2) * g * g;
+		m[i] = mm;
+		v[i] = vv;
+
+		p[i].data = w * decay - lr * (mm * c1) / (sqrt(vv * c2) + eps);
+	}
+}
+
+// updates params <st, en). Optim_begin() must be called before
+void Optim_stepRange(Optim *self, const int st, const int en)
+{
+	if (self->type == Optim_SGD)
+		_Optim_sgd(self, st, en);
+	else
+		_Optim_adam(self, st, en);
+}
+
+void _Optim_stepRangeJob(void *prm, int st, int en)
+{
+	Optim_stepRange(prm, st, en);
+}
+
+// prepares new step(bias corrections)
+void Optim_begin(Optim *self)
+{
+	self->step++;
+	if (self->type != Optim_SGD)
+	{
+		self->c1 = 1 / (1 - pow(self->beta1, self->step));
+		self->c2 = 1 / (1 - pow(self->beta2, self->step));
+	}
+}
+
+void Optim_step(Optim *self)
+{
+	Optim_begin(self);
+	Optim_stepRange(self, 0, self->params->num_values);
+}
+
+// params are split between TopoMT threads
+void Optim_stepMT(Optim *self, TopoMT *mt)
+{
+	Optim_begin(self);
+	TopoMT_parallelFor(mt, &_Optim_stepRangeJob, self, self->params->num_values);
+}
@@ -0,0 +1,427 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Rewrites graph before Topo_new(). Graph is copied into new nodes, old nodes are left as they are:
+// - folding: node with only literal operands(VA_literal()) becomes literal
+// - CSE: nodes with same op and operands are shared, literals with same value too
+// - pow: integer exponent 1..64 becomes multiplies(exponent of POW_CONST is read once, here)
+// - chains: ADD/MUL chains(inner nodes have one user) are rebuilt as balanced trees, depth is log2(n) instead of n
+// Leaves which aren't literals(weights, inputs) are kept, so ParamStore and inputs still work.
+// Balanced trees add in different order, so results can differ by rounding.
+
+#define Optimize_MAX_POW 64
+
+typedef struct OptimizeReport_s
+{
+	int nodes_before, layers_before;
+	int nodes_after, layers_after;
+
+	int folded; // nodes computed from literals
+	int merged; // nodes replaced by same existing node
+	int pows;	// pow() replaced by multiplies
+	int chains; // chains rebuilt as balanced trees
+} OptimizeReport;
+
+typedef struct _Optimize_s
+{
+	ValueAllocator *allocator;
+	OptimizeReport *report;
+
+	Value **table; // hash set of new nodes
+	unsigned int table_mask;
+	unsigned int table_num;
+} _Optimize;
+
+unsigned long long _Optimize_mix(unsigned long long h, const unsigned long long x)
+{
+	return (h ^ x) * 1099511628211ULL;
+}
+
+unsigned long long _Optimize_hash(const Value *v)
+{
+	unsigned long long h = _Optimize_mix(14695981039346656037ULL, v->op);
+	if (v->op == Value_OP_EMPTY)
+	{
+		unsigned long long bits;
+		memcpy(&bits, &v->data, sizeof(bits));
+		h = _Optimize_mix(h, bits);
+	}
+	else if (v->op == Value_OP_DOT || v->op == Value_OP_SUM)
+	{
+		int num;
+		Value **args = Value_getPrevs((Value *)v, &num);
+		for (int i = 0; i < num; i++)
+			h = _Optimize_mix(h, (size_t)args[i]);
+	}
+	else
+	{
+		h = _Optimize_mix(h, (size_t)v->prevs[0]);
+		h = _Optimize_mix(h, (size_t)v->prevs[1]);
+	}
+	return h ^ (h >> 29);
+}
+
+char _Optimize_equal(const Value *a, const Value *b)
+{
+	if (a->op != b->op)
+		return 0;
+	if (a->op == Value_OP_EMPTY)
+		return a->literal && b->literal && memcmp(&a->data, &b->data, sizeof(double)) == 0;
+	if (a->op == Value_OP_DOT || a->op == Value_OP_SUM)
+	{
+		int num;
+		Value **args = Value_getPrevs((Value *)a, &num);
+		return a->num_args == b->num_args && memcmp(args, b->args, num * sizeof(Value *)) == 0;
+	}
+	return a->prevs[0] == b->prevs[0] && a->prevs[1] == b->prevs[1];
+}
+
+void _Optimize_insert(_Optimize *self, Value *v)
+{
+	if (2 * (self->table_num + 1) > self->table_mask + 1)
+	{
+		// grows
+		Value **old = self->table;
+		const unsigned int old_size = self->table_mask + 1;
+		self->table_mask = 2 * old_size - 1;
+		self->table = malloc(2 * old_size * sizeof(Value *));
+		memset(self->table, 0, 2 * old_size * sizeof(Value *));
+		self->table_num = 0;
+		for (unsigned int i = 0; i < old_size; i++)
+			if (old[i])
+				_Optimize_insert(self, old[i]);
+		free(old);
+	}
+
+	unsigned int i = _Optimize_hash(v) & self->table_mask;
+	while (self->table[i])
+		i = (i + 1) & self->table_mask;
+	self->table[i] = v;
+	self->table_num++;
+}
+
+Value *_Optimize_find(_Optimize *self, const Value *v)
+{
+	unsigned int i = _Optimize_hash(v) & self->table_mask;
+	while (self->table[i])
+	{
+		if (_Optimize_equal(self->table[i], v))
+			return self->table[i];
+		i = (i + 1) & self->table_mask;
+	}
+	return 0;
+}
+
+// returns shared node same as 'v' or 'v' itself, which becomes shared
+Value *_Optimize_share(_Optimize *self, Value *v)
+{
+	Value *found = _Optimize_find(self, v);
+	if (found)
+	{
+		self->report->merged++;
+		return found;
+	}
+	_Optimize_insert(self, v);
+	return v;
+}
+
+Value *_Optimize_literal(_Optimize *self, const double data)
+{
+	Value tmp;
+	_Value_init(&tmp, data, Value_OP_EMPTY);
+	tmp.literal = 1;
+
+	Value *found = _Optimize_find(self, &tmp);
+	if (found)
+		return found;
+
+	Value *v = VA_literal(self->allocator, data);
+	_Optimize_insert(self, v);
+	return v;
+}
+
+// unary/binary node from new operands
+Value *_Optimize_make(_Optimize *self, const Value_OP op, Value *a, Value *b)
+{
+	if ((op == Value_OP_ADD || op == Value_OP_MUL) && a > b)
+	{
+		// commutative, operands are ordered, so a + b and b + a are same node
+		Value *t = a;
+		a = b;
+		b = t;
+	}
+
+	Value tmp;
+	_Value_init(&tmp, 0, op);
+	Value_setPre2(&tmp, a, b);
+
+	if (a->literal && (!b || b->literal))
+	{
+		self->report->folded++;
+		Value_forward(&tmp);
+		return _Optimize_literal(self, tmp.data);
+	}
+
+	Value *found = _Optimize_find(self, &tmp);
+	if (found)
+	{
+		self->report->merged++;
+		return found;
+	}
+
+	Value *v = _Value_init(ValueAllocator_alloc(self->allocator), 0, op);
+	Value_setPre2(v, a, b);
+	_Optimize_insert(self, v);
+	return v;
+}
+
+// DOT/SUM node, 'args' are new operands(2 * num_args for DOT)
+Value *_Optimize_makeN(_Optimize *self, const Value_OP op, Value **args, const int num_args)
+{
+	const int num = (op == Value_OP_DOT) ? 2 * num_args : num_args;
+
+	Value tmp;
+	_Value_init(&tmp, 0, op);
+	tmp.args = args;
+	tmp.num_args = num_args;
+
+	char literal = 1;
+	for (int i = 0; i < num; i++)
+		literal &= args[i]->literal;
+	if (literal)
+	{
+		self->report->folded++;
+		Value_forward(&tmp);
+		return _Optimize_literal(self, tmp.data);
+	}
+
+	Value *found = _Optimize_find(self, &tmp);
+	if (found)
+	{
+		self->report->merged++;
+		return found;
+	}
+
+	Value *v = _Value_init(ValueAllocator_alloc(self->allocator), 0, op);
+	v->args = ValueAllocator_allocArgs(self->allocator, num);
+	v->num_args = num_args;
+	memcpy(v->args, args, num * sizeof(Value *));
+	_Optimize_insert(self, v);
+	return v;
+}
+
+// pairwise, 'terms' are overwritten
+Value *_Optimize_tree(_Optimize *self, const Value_OP op, Value **terms, int n)
+{
+	while (n > 1)
+	{
+		int m = 0;
+		for (int i = 0; i + 1 < n; i += 2)
+			terms[m++] = _Optimize_make(self, op, terms[i], terms[i + 1]);
+		if (n & 1)
+			terms[m++] = terms[n - 1];
+		n = m;
+	}
+	return terms[0];
+}
+
+// x^n by squaring
+Value *_Optimize_pow(_Optimize *self, Value *x, int n)
+{
+	Value *ret = 0;
+	while (n)
+	{
+		if (n & 1)
+			ret = ret ? _Optimize_make(self, Value_OP_MUL, ret, x) : x;
+		n >>= 1;
+		if (n)
+			x = _Optimize_make(self, Value_OP_MUL, x, x);
+	}
+	return ret;
+}
+
+// optimizes graph of 'roots' into 'allocator', new roots are written into 'out'(can be 'roots'). Gradient of sum of roots is kept
+OptimizeReport Optimize_graph(Value **roots, const int num_roots, Value **out, ValueAllocator *allocator)
+{
+	OptimizeReport report;
+	memset(&report, 0, sizeof(OptimizeReport));
+
+	Topo *topo = Topo_newMulti(roots, num_roots);
+	Topo_buildUsers(topo);
+	const int N = Topo_numParameters(topo);
+	report.nodes_before = N;
+	report.layers_before = topo->num_layers;
+
+	_Optimize self;
+	self.allocator = allocator;
+	self.report = &report;
+	self.table_mask = 1024 - 1;
+	while (self.table_mask + 1 < 2 * (unsigned int)N)
+		self.table_mask = 2 * self.table_mask + 1;
+	self.table = malloc((self.table_mask + 1) * sizeof(Value *));
+	memset(self.table, 0, (self.table_mask + 1) * sizeof(Value *));
+	self.table_num = 0;
+
+	Value **map = malloc(Std_bmax(1, N) * sizeof(Value *)); // old node index -> new node
+	memset(map, 0, N * sizeof(Value *));
+	char *is_root = malloc(Std_bmax(1, N));
+	memset(is_root, 0, N);
+
+	int max_tmp = 1024;
+	Value **tmp = malloc(max_tmp * sizeof(Value *));   // new operands, chain terms
+	Value **stack = malloc(max_tmp * sizeof(Value *)); // chain walk
+
+	// old nodes are looked up by Topo index(Topo_buildUsers() built it)
+#define _Optimize_I(V) Topo_indexOf(topo, (V))
+	for (int r = 0; r < topo->num_roots; r++)
+		is_root[_Optimize_I(topo->roots[r])] = 1;
+
+// inner node of chain, its only user has same op and flattens it
+#define _Optimize_IS_INNER(V) (((V)->op == Value_OP_ADD || (V)->op == Value_OP_MUL) && !is_root[_Optimize_I(V)] && \
+							   topo->user_offsets[_Optimize_I(V) + 1] - topo->user_offsets[_Optimize_I(V)] == 1 && \
+							   topo->users[topo->user_offsets[_Optimize_I(V)]].user->op == (V)->op)
+
+	for (int i = 0; i < topo->num_layers; i++)
+	{
+		TopoLayer *layer = &topo->layers[i];
+		for (int ii = 0; ii < layer->num_values; ii++)
+		{
+			Value *v = layer->values[ii];
+			Value **m = &map[layer->first + ii];
+
+			int num;
+			Value **prevs = Value_getPrevs(v, &num);
+			if (num > max_tmp)
+			{
+				max_tmp = num;
+				tmp = realloc(tmp, max_tmp * sizeof(Value *));
+				stack = realloc(stack, max_tmp * sizeof(Value *));
+			}
+
+			switch (v->op)
+			{
+			case Value_OP_EMPTY:
+				*m = v->literal ? _Optimize_share(&self, v) : v;
+				break;
+
+			case Value_OP_ADD:
+			case Value_OP_MUL:
+			{
+				if (_Optimize_IS_INNER(v))
+				{
+					*m = 0; // top of chain builds it
+					break;
+				}
+
+				// left-to-right terms of chain
+				int num_terms = 0, num_stack = 0;
+				stack[num_stack++] = prevs[1];
+				stack[num_stack++] = prevs[0];
+				while (num_stack)
+				{
+					Value *p = stack[--num_stack];
+					if (num_terms + num_stack + 2 > max_tmp)
+					{
+						max_tmp *= 2;
+						tmp = realloc(tmp, max_tmp * sizeof(Value *));
+						stack = realloc(stack, max_tmp * sizeof(Value *));
+					}
+
+					if (_Optimize_IS_INNER(p))
+					{
+						stack[num_stack++] = p->prevs[1];
+						stack[num_stack++] = p->prevs[0];
+					}
+					else
+						tmp[num_terms++] = map[_Optimize_I(p)];
+				}
+				report.chains += (num_terms > 2);
+				*m = _Optimize_tree(&self, v->op, tmp, num_terms);
+				break;
+			}
+
+			case Value_OP_POW_CONST:
+			{
+				const double e = prevs[1]->data;
+				if (e >= 1 && e <= Optimize_MAX_POW && e == (int)e)
+				{
+					report.pows++;
+					*m = _Optimize_pow(&self, map[_Optimize_I(prevs[0])], (int)e);
+				}
+				else
+					*m = _Optimize_make(&self, v->op, map[_Optimize_I(prevs[0])], map[_Optimize_I(prevs[1])]);
+				break;
+			}
+
+			case Value_OP_DOT:
+			case Value_OP_SUM:
+				for (int p = 0; p < num; p++)
+					tmp[p] = map[_Optimize_I(prevs[p])];
+				*m = _Optimize_makeN(&self, v->op, tmp, v->num_args);
+				break;
+
+			default:
+				*m = _Optimize_make(&self, v->op, map[_Optimize_I(prevs[0])], prevs[1] ? map[_Optimize_I(prevs[1])] : 0);
+				break;
+			}
+		}
+	}
+#undef _Optimize_IS_INNER
+
+	for (int r = 0; r < num_roots; r++)
+		out[r] = roots[r] ? map[_Optimize_I(roots[r])] : 0;
+#undef _Optimize_I
+
+	// merged roots would get grad 1 only once, every one gets own pass-through node. Same root passed twice is counted once, like in Topo_newMulti()
+	for (int r = 0; r < num_roots; r++)
+	{
+		int same = -1;
+		for (int rr = 0; rr < r && same < 0; rr++)
+			if (roots[rr] == roots[r])
+				same = rr;
+		if (same >= 0)
+		{
+			out[r] = out[same];
+			continue;
+		}
+
+		for (int rr = 0; rr < r && out[r]; rr++)
+			if (out[rr] == out[r])
+			{
+				out[r] = VA_sum(allocator, &out[r], 1);
+				break;
+			}
+	}
+
+	free(map);
+	free(is_root);
+	free(tmp);
+	free(stack);
+	free(self.table);
+	Topo_delete(topo);
+
+	Topo *after = Topo_newMulti(out, num_roots);
+	report.nodes_after = Topo_numParameters(after);
+	report.layers_after = after->num_layers;
+	Topo_delete(after);
+
+	return report;
+}
+
+void OptimizeReport_print(const OptimizeReport *self)
+{
+	printf("nodes: %d -> %d, layers: %d -> %d(folded: %d, merged: %d, pows: %d, chains: %d)\n", self->nodes_before, self->nodes_after, self->layers_before, self->layers_after, self->folded, self->merged, self->pows, self->chains);
+}
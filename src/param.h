@@ -0,0 +1,68 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// ParamStore keeps trainable Values(weights, biases) in one contiguous array.
+// Update step runs over this array only, so inputs, constants and intermediate Values are never touched.
+// Params live outside of ValueAllocator, graph can be rebuilt without losing weights.
+typedef struct ParamStore_s
+{
+	Value *values;
+	int num_values;
+	int max_values;
+} ParamStore;
+
+ParamStore *ParamStore_new(const int max_values)
+{
+	ParamStore *self = malloc(sizeof(ParamStore));
+	self->max_values = max_values;
+	self->num_values = 0;
+	self->values = malloc(Std_bmax(1, max_values) * sizeof(Value));
+	memset(self->values, 0, Std_bmax(1, max_values) * sizeof(Value));
+	return self;
+}
+
+void ParamStore_delete(ParamStore *self)
+{
+	memset(self->values, 0, Std_bmax(1, self->max_values) * sizeof(Value));
+	free(self->values);
+
+	memset(self, 0, sizeof(ParamStore));
+	free(self);
+}
+
+// adds leaf Value, returns 0 when store is full
+Value *ParamStore_add(ParamStore *self, const double data)
+{
+	if (self->num_values >= self->max_values)
+		return 0;
+
+	return _Value_init(&self->values[self->num_values++], data, Value_OP_EMPTY);
+}
+
+void ParamStore_zeroGrads(ParamStore *self)
+{
+	for (int i = 0; i < self->num_values; i++)
+		self->values[i].grad = 0;
+}
+
+// data += val * grad
+void ParamStore_update(ParamStore *self, const double val)
+{
+	Value *values = self->values;
+	for (int i = 0; i < self->num_values; i++)
+		values[i].data += val * values[i].grad;
+}
+
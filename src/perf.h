@@ -0,0 +1,188 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Hardware counters(perf_event_open) summed per phase of training step.
+// Counters are inherited by threads created after Perf_new(), so create TopoMT after it to count workers too.
+// Counter which can't be opened(no PMU in VM, perf_event_paranoid) stays -1.
+
+typedef enum
+{
+	Perf_CYCLES,
+	Perf_INSTRUCTIONS,
+	Perf_LLC_MISSES,
+	Perf_BRANCH_MISSES,
+	Perf_NUM,
+} Perf_COUNTER;
+
+typedef enum
+{
+	PerfPhase_FORWARD,
+	PerfPhase_BACKWARD,
+	PerfPhase_RESET, // grads reset
+	PerfPhase_UPDATE,
+	PerfPhase_NUM,
+} Perf_PHASE;
+
+const char *Perf_NAMES[] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+const char *PerfPhase_NAMES[] = {"forward", "backward", "reset", "update"};
+
+typedef struct Perf_s
+{
+	int fds[Perf_NUM];
+	long long start[Perf_NUM];			   // counters at Perf_begin()
+	long long values[PerfPhase_NUM][Perf_NUM]; // -1 = not available
+} Perf;
+
+long long _Perf_read(const int fd)
+{
+	long long value;
+	if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+		return -1;
+	return value;
+}
+
+Perf *Perf_new(void)
+{
+	const unsigned long long configs[Perf_NUM] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES, // last level cache
+		PERF_COUNT_HW_BRANCH_MISSES,
+	};
+
+	Perf *self = malloc(sizeof(Perf));
+	for (int i = 0; i < Perf_NUM; i++)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = configs[i];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1; // + worker threads
+
+		self->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0); // this process, any CPU
+		self->start[i] = 0;
+	}
+
+	for (int p = 0; p < PerfPhase_NUM; p++)
+		for (int i = 0; i < Perf_NUM; i++)
+			self->values[p][i] = (self->fds[i] < 0) ? -1 : 0;
+
+	return self;
+}
+
+void Perf_delete(Perf *self)
+{
+	for (int i = 0; i < Perf_NUM; i++)
+		if (self->fds[i] >= 0)
+			close(self->fds[i]);
+
+	memset(self, 0, sizeof(Perf));
+	free(self);
+}
+
+// returns 1 if at least one counter works
+char Perf_isAvailable(const Perf *self)
+{
+	for (int i = 0; i < Perf_NUM; i++)
+		if (self->fds[i] >= 0)
+			return 1;
+	return 0;
+}
+
+void Perf_reset(Perf *self)
+{
+	for (int p = 0; p < PerfPhase_NUM; p++)
+		for (int i = 0; i < Perf_NUM; i++)
+			self->values[p][i] = (self->fds[i] < 0) ? -1 : 0;
+}
+
+void Perf_begin(Perf *self)
+{
+	for (int i = 0; i < Perf_NUM; i++)
+		self->start[i] = _Perf_read(self->fds[i]);
+}
+
+// adds counts since Perf_begin() into 'phase'
+void Perf_end(Perf *self, const Perf_PHASE phase)
+{
+	for (int i = 0; i < Perf_NUM; i++)
+	{
+		const long long value = _Perf_read(self->fds[i]);
+		if (value >= 0 && self->start[i] >= 0)
+			self->values[phase][i] += value - self->start[i];
+	}
+}
+
+long long Perf_get(const Perf *self, const Perf_PHASE phase, const Perf_COUNTER counter)
+{
+	return self->values[phase][counter];
+}
+
+void Perf_print(const Perf *self, FILE *f)
+{
+	if (!Perf_isAvailable(self))
+	{
+		fprintf(f, "perf counters are not available(no PMU or perf_event_paranoid)\n");
+		return;
+	}
+
+	fprintf(f, "phase    | %14s | %14s | %12s | %13s | IPC  | LLC miss/1K instr | branch miss/1K instr\n", Perf_NAMES[0], Perf_NAMES[1], Perf_NAMES[2], Perf_NAMES[3]);
+	for (int p = 0; p < PerfPhase_NUM; p++)
+	{
+		const long long *v = self->values[p];
+		const double instr = v[Perf_INSTRUCTIONS] > 0 ? v[Perf_INSTRUCTIONS] : 0;
+		fprintf(f, "%-8s | %14lld | %14lld | %12lld | %13lld | %4.2f | %17.2f | %20.2f\n", PerfPhase_NAMES[p],
+				v[Perf_CYCLES], v[Perf_INSTRUCTIONS], v[Perf_LLC_MISSES], v[Perf_BRANCH_MISSES],
+				(v[Perf_CYCLES] > 0 && instr) ? instr / v[Perf_CYCLES] : 0,
+				(instr && v[Perf_LLC_MISSES] >= 0) ? v[Perf_LLC_MISSES] * 1000 / instr : 0,
+				(instr && v[Perf_BRANCH_MISSES] >= 0) ? v[Perf_BRANCH_MISSES] * 1000 / instr : 0);
+	}
+}
+
+// Topo_run() with phases counted into 'perf'
+void Topo_runPerf(Topo *self, Perf *perf)
+{
+	Perf_begin(perf);
+	Topo_forward(self);
+	Perf_end(perf, PerfPhase_FORWARD);
+
+	Perf_begin(perf);
+	Topo_resetGrads(self);
+	Perf_end(perf, PerfPhase_RESET);
+
+	Perf_begin(perf);
+	Topo_backprop(self);
+	Perf_end(perf, PerfPhase_BACKWARD);
+}
+
+// TopoMT_run() with phases counted into 'perf'. Every phase starts and joins workers, so it's slower than TopoMT_run()
+void TopoMT_runPerf(TopoMT *self, Topo *topo, Perf *perf)
+{
+	Perf_begin(perf);
+	TopoMT_runPhases(self, topo, TopoMT_PHASE_FORWARD);
+	Perf_end(perf, PerfPhase_FORWARD);
+
+	Perf_begin(perf);
+	TopoMT_runPhases(self, topo, TopoMT_PHASE_RESET);
+	Perf_end(perf, PerfPhase_RESET);
+
+	Perf_begin(perf);
+	TopoMT_runPhases(self, topo, TopoMT_PHASE_BACKWARD);
+	Perf_end(perf, PerfPhase_BACKWARD);
+}
@@ -0,0 +1,140 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Pipelined training of microbatches. Threads are split into two stages: caller drives forward stage, stage thread drives backward stage.
+// Backward of microbatch j runs while forward of microbatch j + 1 runs on other cores.
+// Weights are only read by forward and backward accumulates their grads, so stages don't touch same memory.
+// Every microbatch needs own topo(and own inputs), weights are shared. Update weights after whole Pipe_run().
+typedef struct Pipe_s
+{
+	TopoMT *fwd; // caller is thread #0
+	TopoMT *bwd; // 'thread' is thread #0
+
+	StdThread thread;
+	OsSemaphore semaphore_work;
+	OsSemaphore semaphore_done;
+	Topo *volatile bwd_topo; // 0 = exit
+
+	// last Pipe_run()
+	double time_fwd; // forward stage busy
+	double time_bwd; // backward stage busy
+	double time_run; // wall
+	int num_topos;
+} Pipe;
+
+StdThread_FUNC(_Pipe_loop, arg)
+{
+	Pipe *self = arg;
+	while (OsSemaphore_wait(&self->semaphore_work))
+	{
+		Topo *topo = self->bwd_topo;
+		if (!topo)
+			break;
+
+		const double st = Os_timeMono();
+		TopoMT_runPhases(self->bwd, topo, TopoMT_PHASE_RESET_INNER | TopoMT_PHASE_BACKWARD);
+		self->time_bwd += Os_timeMono() - st;
+
+		OsSemaphore_trigger(&self->semaphore_done);
+	}
+	return 0;
+}
+
+// 'num_threads' are split between stages, <= 0 = all CPUs
+Pipe *Pipe_new(int num_threads)
+{
+	Pipe *self = malloc(sizeof(Pipe));
+	num_threads = (num_threads <= 0) ? Std_numberOfThreads() : num_threads;
+
+	// same # of threads, so topo plans fit both stages
+	const int stage_threads = Std_bmax(1, num_threads / 2);
+	self->fwd = TopoMT_new(stage_threads);
+	self->bwd = TopoMT_new(stage_threads);
+
+	self->bwd_topo = 0;
+	self->time_fwd = 0;
+	self->time_bwd = 0;
+	self->time_run = 0;
+	self->num_topos = 0;
+
+	OsSemaphore_init(&self->semaphore_work);
+	OsSemaphore_init(&self->semaphore_done);
+	StdThread_init(&self->thread, "Pipe", &_Pipe_loop, self);
+	return self;
+}
+
+void Pipe_delete(Pipe *self)
+{
+	self->bwd_topo = 0;
+	OsSemaphore_trigger(&self->semaphore_work);
+	StdThread_free(&self->thread);
+
+	OsSemaphore_free(&self->semaphore_work);
+	OsSemaphore_free(&self->semaphore_done);
+	TopoMT_delete(self->fwd);
+	TopoMT_delete(self->bwd);
+
+	memset(self, 0, sizeof(Pipe));
+	free(self);
+}
+
+// forward + backward of all microbatches. Grads of weights are accumulated(sum of all roots of all topos), so zero them before
+void Pipe_run(Pipe *self, Topo **topos, const int num_topos)
+{
+	// plan(with users for gather) is shared by both stages, so they must agree on backward and it's made before they start
+	TopoMT_setBackward(self->fwd, self->bwd->backward);
+	for (int j = 0; j < num_topos; j++)
+		if (!TopoMT_isPlanned(self->bwd, topos[j]))
+			TopoMT_plan(self->bwd, topos[j]);
+
+	self->time_fwd = 0;
+	self->time_bwd = 0;
+	self->num_topos = num_topos;
+	const double st_run = Os_timeMono();
+
+	double st = Os_timeMono();
+	if (num_topos)
+		TopoMT_forward(self->fwd, topos[0]);
+	self->time_fwd += Os_timeMono() - st;
+
+	for (int j = 0; j < num_topos; j++)
+	{
+		// backward of j on stage thread
+		self->bwd_topo = topos[j];
+		OsSemaphore_trigger(&self->semaphore_work);
+
+		// forward of j + 1 meanwhile
+		if (j + 1 < num_topos)
+		{
+			st = Os_timeMono();
+			TopoMT_forward(self->fwd, topos[j + 1]);
+			self->time_fwd += Os_timeMono() - st;
+		}
+
+		OsSemaphore_wait(&self->semaphore_done);
+	}
+
+	self->time_run = Os_timeMono() - st_run;
+}
+
+// overlap is part of shorter stage hidden behind other stage
+void Pipe_print(const Pipe *self, const int samples_per_topo)
+{
+	const double overlap = fmax(0, self->time_fwd + self->time_bwd - self->time_run) / fmax(1e-12, fmin(self->time_fwd, self->time_bwd));
+	printf("Pipe(%d+%d threads): forward %.3fms, backward %.3fms, wall %.3fms, overlap %.1f%%, %.0f samples/s\n",
+		   self->fwd->num_threads, self->bwd->num_threads, self->time_fwd * 1000, self->time_bwd * 1000, self->time_run * 1000,
+		   100 * fmin(1, overlap), self->num_topos * samples_per_topo / fmax(1e-12, self->time_run));
+}
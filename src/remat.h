@@ -0,0 +1,432 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Gradient checkpointing(rematerialization). Topo layers are split into segments of 'seg_len' layers.
+// Kept nodes(leaves, last layer, nodes read by later segment) have own data+grad, other nodes share one scratch segment.
+// Backward walks segments from last to first, recomputes scratch nodes of segment from kept nodes and backpropagates it.
+// Segment length is picked from memory budget, shorter segments need less scratch but keep more nodes.
+// Only leaves are referenced after Remat_new(), so computed Values can be released(ValueAllocator_release()) and Remat replaces them.
+
+typedef struct Remat_s
+{
+	Value **leaves; // leaf i is in slot i
+	int num_leaves;
+	int num_nodes; // computed nodes in topo order, node i is topo value num_leaves + i
+
+	// operands are storage slots
+	unsigned char *ops;
+	unsigned int *out;
+	unsigned int *a;
+	unsigned int *b; // n-ary: num_args
+	unsigned int *args;
+	char *kept;
+
+	int seg_len; // in topo layers
+	int num_segments;
+	int *segments; // node range of segment i is <segments[i], segments[i + 1])
+
+	double *data; // <0, num_kept) kept, <num_kept, num_kept + num_scratch) scratch
+	double *grad;
+	int num_kept;
+	int num_scratch;
+	int num_last; // last layer <num_nodes - num_last, num_nodes), grads start with 1
+
+	long long flops;	   // one forward pass
+	long long extra_flops; // recomputation in one backward pass
+
+	size_t program_bytes; // ops, out, a, b, args, kept, segments
+	size_t graph_bytes;	  // computed Values and their operands, Topo_run() needs them
+} Remat;
+
+long long _Remat_flops(const Value *v)
+{
+	switch (v->op)
+	{
+	case Value_OP_EMPTY:
+		return 0;
+	case Value_OP_DOT:
+		return 2 * (long long)v->num_args;
+	case Value_OP_SUM:
+		return v->num_args;
+	default:
+		return 1;
+	}
+}
+
+// computes storage of segment length 'seg_len'. layer_of/max_user are per node, returns # of doubles(data + grad) of computed nodes
+size_t _Remat_plan(Topo *topo, Value **values, const int *layer_of, const int *max_user, const int num_nodes, const int seg_len, int *out_kept, int *out_scratch, long long *out_extra)
+{
+	const int last_layer = topo->num_layers - 1;
+	const int last_seg = (last_layer - 2) / seg_len; // of last inner layer
+
+	int kept = 0, scratch = 0, seg_scratch = 0, seg = -1;
+	long long extra = 0;
+	for (int i = 0; i < num_nodes; i++)
+	{
+		const int l = layer_of[i];
+		if (l == 0 || l == last_layer)
+		{
+			kept++;
+			continue;
+		}
+
+		const int s = (l - 1) / seg_len;
+		if (s != seg)
+		{
+			seg = s;
+			seg_scratch = 0;
+		}
+
+		if ((layer_of[max_user[i]] - 1) / seg_len != s || layer_of[max_user[i]] == last_layer)
+			kept++; // read by later segment
+		else
+		{
+			seg_scratch++;
+			scratch = Std_bmax(scratch, seg_scratch);
+			if (s != last_seg)
+				extra += _Remat_flops(values[i]);
+		}
+	}
+
+	*out_kept = kept;
+	*out_scratch = scratch;
+	*out_extra = extra;
+	return 2 * ((size_t)kept - (topo->num_layers ? topo->layers[0].num_values : 0) + scratch);
+}
+
+size_t _Remat_programBytes(const int num_nodes, const int num_args, const int num_segments)
+{
+	return (size_t)num_nodes * (sizeof(unsigned char) + 3 * sizeof(unsigned int) + sizeof(char)) + (size_t)num_args * sizeof(unsigned int) + (num_segments + 1) * sizeof(int);
+}
+
+// 'budget' is max bytes of program and of data and grads of computed nodes(leaves are always kept). When nothing fits, smallest plan is used
+// Outputs are values of last layer, so multi-root topo(Topo_newMulti()) must have all roots there, they are read by Remat_output()
+Remat *Remat_new(Topo *topo, const size_t budget)
+{
+	Remat *self = malloc(sizeof(Remat));
+	memset(self, 0, sizeof(Remat));
+	const int N = Topo_numParameters(topo);
+	Value **values = malloc(Std_bmax(1, N) * sizeof(Value *));
+	int *layer_of = malloc(Std_bmax(1, N) * sizeof(int));
+	int *max_user = malloc(Std_bmax(1, N) * sizeof(int));
+
+	// node i is Topo value with index i
+	Topo_buildIndex(topo);
+	int n = 0;
+	int n_args = 0;
+	for (int i = 0; i < topo->num_layers; i++)
+	{
+		TopoLayer *layer = &topo->layers[i];
+		for (int ii = 0; ii < layer->num_values; ii++)
+		{
+			Value *v = layer->values[ii];
+			int num;
+			Value **prevs = Value_getPrevs(v, &num);
+			for (int p = 0; p < num; p++)
+				if (prevs[p])
+					max_user[Topo_indexOf(topo, prevs[p])] = n; // users come later, so last write is max
+			if (v->op == Value_OP_DOT || v->op == Value_OP_SUM)
+				n_args += num;
+
+			values[n] = v;
+			layer_of[n] = i;
+			max_user[n] = n;
+			self->flops += _Remat_flops(v);
+			n++;
+		}
+	}
+	self->num_leaves = topo->num_layers ? topo->layers[0].num_values : 0;
+	self->num_nodes = N - self->num_leaves;
+	self->num_last = (topo->num_layers > 1) ? topo->layers[topo->num_layers - 1].num_values : 0;
+	self->leaves = malloc(Std_bmax(1, self->num_leaves) * sizeof(Value *));
+	memcpy(self->leaves, values, self->num_leaves * sizeof(Value *));
+	self->graph_bytes = (size_t)self->num_nodes * sizeof(Value) + (size_t)n_args * sizeof(Value *);
+
+	// picks segment length with smallest recomputation which fits into budget
+	const int last_layer = topo->num_layers - 1;
+	const int num_inner = Std_bmax(1, topo->num_layers - 2); // without leaves and last layer
+	size_t best_size = 0;
+	long long best_extra = 0;
+	for (int L = 1; L <= num_inner; L += Std_bmax(1, L / 8))
+	{
+		int kept, scratch;
+		long long extra;
+		const int num_segments = (topo->num_layers > 2) ? (last_layer - 2) / L + 1 : 0;
+		const size_t size = _Remat_plan(topo, values, layer_of, max_user, N, L, &kept, &scratch, &extra) * sizeof(double) + _Remat_programBytes(self->num_nodes, n_args, num_segments);
+
+		const char fits = size <= budget;
+		const char best_fits = best_size <= budget;
+		if (self->seg_len == 0 ||
+			(fits && (!best_fits || extra < best_extra)) ||
+			(!fits && !best_fits && size < best_size))
+		{
+			self->seg_len = L;
+			best_size = size;
+			best_extra = extra;
+		}
+	}
+	_Remat_plan(topo, values, layer_of, max_user, N, self->seg_len, &self->num_kept, &self->num_scratch, &self->extra_flops);
+
+	// segments and slots
+	self->num_segments = (topo->num_layers > 2) ? (last_layer - 2) / self->seg_len + 1 : 0;
+	self->program_bytes = _Remat_programBytes(self->num_nodes, n_args, self->num_segments);
+	self->segments = malloc((self->num_segments + 1) * sizeof(int));
+	self->kept = malloc(Std_bmax(1, self->num_nodes));
+	unsigned int *slot = malloc(Std_bmax(1, N) * sizeof(unsigned int)); // per topo value, leaves come first, so leaf i gets slot i
+	int n_kept = 0, seg = -1, seg_scratch = 0;
+	for (int i = 0; i < N; i++)
+	{
+		const int l = layer_of[i];
+		const int s = (l > 0 && l < last_layer) ? (l - 1) / self->seg_len : -1;
+		if (s >= 0 && s != seg)
+		{
+			seg = s;
+			seg_scratch = 0;
+			self->segments[s] = i - self->num_leaves;
+		}
+
+		const char kept = (s < 0 || (layer_of[max_user[i]] - 1) / self->seg_len != s || layer_of[max_user[i]] == last_layer);
+		if (i >= self->num_leaves)
+			self->kept[i - self->num_leaves] = kept;
+		slot[i] = kept ? n_kept++ : self->num_kept + seg_scratch++;
+	}
+	self->segments[self->num_segments] = self->num_nodes - self->num_last;
+
+	// operands in slot space
+	self->ops = malloc(Std_bmax(1, self->num_nodes));
+	self->out = malloc(Std_bmax(1, self->num_nodes) * sizeof(unsigned int));
+	self->a = malloc(Std_bmax(1, self->num_nodes) * sizeof(unsigned int));
+	self->b = malloc(Std_bmax(1, self->num_nodes) * sizeof(unsigned int));
+	self->args = malloc(Std_bmax(1, n_args) * sizeof(unsigned int));
+	n_args = 0;
+	for (int i = 0; i < self->num_nodes; i++)
+	{
+		Value *v = values[self->num_leaves + i];
+		self->ops[i] = v->op;
+		self->out[i] = slot[self->num_leaves + i];
+		if (v->op == Value_OP_DOT || v->op == Value_OP_SUM)
+		{
+			int num;
+			Value **prevs = Value_getPrevs(v, &num);
+			self->a[i] = n_args;
+			self->b[i] = v->num_args;
+			for (int p = 0; p < num; p++)
+				self->args[n_args++] = slot[Topo_indexOf(topo, prevs[p])];
+		}
+		else
+		{
+			self->a[i] = v->prevs[0] ? slot[Topo_indexOf(topo, v->prevs[0])] : 0;
+			self->b[i] = v->prevs[1] ? slot[Topo_indexOf(topo, v->prevs[1])] : 0;
+		}
+	}
+
+	const size_t size = Std_bmax(1, self->num_kept + self->num_scratch) * sizeof(double);
+	self->data = malloc(size);
+	self->grad = malloc(size);
+	memset(self->data, 0, size);
+	memset(self->grad, 0, size);
+
+	free(values);
+	free(layer_of);
+	free(max_user);
+	free(slot);
+	return self;
+}
+
+void Remat_delete(Remat *self)
+{
+	free(self->leaves);
+	free(self->ops);
+	free(self->out);
+	free(self->a);
+	free(self->b);
+	free(self->args);
+	free(self->kept);
+	free(self->segments);
+	free(self->data);
+	free(self->grad);
+
+	memset(self, 0, sizeof(Remat));
+	free(self);
+}
+
+void _Remat_forwardNode(Remat *self, const int i)
+{
+	double *data = self->data;
+	const unsigned int a = self->a[i];
+	const unsigned int b = self->b[i];
+	double *out = &data[self->out[i]];
+
+	switch (self->ops[i])
+	{
+	case Value_OP_ADD:
+		*out = data[a] + data[b];
+		break;
+	case Value_OP_SUB:
+		*out = data[a] - data[b];
+		break;
+	case Value_OP_MUL:
+		*out = data[a] * data[b];
+		break;
+	case Value_OP_DIV:
+		*out = data[a] / data[b];
+		break;
+	case Value_OP_POW_CONST:
+		*out = pow(data[a], data[b]);
+		break;
+	case Value_OP_NEG:
+		*out = data[a] * -1;
+		break;
+	case Value_OP_TANH:
+	{
+		const double ex = exp(2 * data[a]);
+		*out = (ex - 1) / (ex + 1);
+		break;
+	}
+	case Value_OP_RELU:
+		*out = (data[a] < 0) ? 0.0 : data[a];
+		break;
+	case Value_OP_DOT:
+		*out = _Tape_dot(data, &self->args[a], &self->args[a + b], b);
+		break;
+	case Value_OP_SUM:
+		*out = _Tape_sum(data, &self->args[a], b);
+		break;
+	default:
+		break;
+	}
+}
+
+void _Remat_backwardNode(Remat *self, const int i)
+{
+	const double *data = self->data;
+	double *grad = self->grad;
+	const unsigned int a = self->a[i];
+	const unsigned int b = self->b[i];
+	const double out = data[self->out[i]];
+	const double g = grad[self->out[i]];
+
+	switch (self->ops[i])
+	{
+	case Value_OP_ADD:
+		grad[a] += g;
+		grad[b] += g;
+		break;
+	case Value_OP_SUB:
+		grad[a] += g;
+		grad[b] -= g; //-=
+		break;
+	case Value_OP_MUL:
+		grad[a] += data[b] * g;
+		grad[b] += data[a] * g;
+		break;
+	case Value_OP_DIV:
+		grad[a] += (1.0 / data[b]) * g;
+		grad[b] -= (data[a] / (data[b] * data[b])) * g; //-=
+		break;
+	case Value_OP_POW_CONST:
+		grad[a] += data[b] * pow(data[a], data[b] - 1) * g;
+		break;
+	case Value_OP_NEG:
+		grad[a] -= g; //-=
+		break;
+	case Value_OP_TANH:
+		grad[a] += (1 - (out * out)) * g;
+		break;
+	case Value_OP_RELU:
+		grad[a] += (out > 0.0) * g;
+		break;
+	case Value_OP_DOT:
+	{
+		const unsigned int *aa = &self->args[a];
+		const unsigned int *bb = &self->args[a + b];
+		for (unsigned int k = 0; k < b; k++)
+		{
+			grad[aa[k]] += data[bb[k]] * g;
+			grad[bb[k]] += data[aa[k]] * g;
+		}
+		break;
+	}
+	case Value_OP_SUM:
+		for (unsigned int k = 0; k < b; k++)
+			grad[self->args[a + k]] += g;
+		break;
+	default:
+		break;
+	}
+}
+
+// copies leaves(inputs, weights) from Values
+void Remat_load(Remat *self)
+{
+	for (int i = 0; i < self->num_leaves; i++)
+		self->data[i] = self->leaves[i]->data;
+}
+
+// copies grads of leaves back into Values
+void Remat_store(Remat *self)
+{
+	for (int i = 0; i < self->num_leaves; i++)
+		self->leaves[i]->grad = self->grad[i];
+}
+
+// data of i-th value of last layer(in topo order), output Values can be released already
+double Remat_output(const Remat *self, const int i)
+{
+	return self->data[self->out[self->num_nodes - self->num_last + i]];
+}
+
+void Remat_run(Remat *self)
+{
+	// forward, scratch is overwritten by every segment
+	for (int i = 0; i < self->num_nodes; i++)
+		_Remat_forwardNode(self, i);
+
+	// resets grads
+	memset(self->grad, 0, self->num_kept * sizeof(double));
+	for (int i = self->num_nodes - self->num_last; i < self->num_nodes; i++)
+		self->grad[self->out[i]] = 1;
+
+	// last layer
+	for (int i = self->num_nodes - 1; i >= self->num_nodes - self->num_last; i--)
+		_Remat_backwardNode(self, i);
+
+	for (int s = self->num_segments - 1; s >= 0; s--)
+	{
+		const int st = self->segments[s];
+		const int en = self->segments[s + 1];
+
+		// last segment is still in scratch from forward pass
+		if (s != self->num_segments - 1)
+			for (int i = st; i < en; i++)
+				if (!self->kept[i])
+					_Remat_forwardNode(self, i);
+
+		memset(&self->grad[self->num_kept], 0, self->num_scratch * sizeof(double));
+		for (int i = en - 1; i >= st; i--)
+			_Remat_backwardNode(self, i);
+	}
+}
+
+void Remat_print(const Remat *self)
+{
+	// leaf Values are needed by both, graph is what Topo_run() keeps resident besides them
+	const size_t activations = 2 * ((size_t)self->num_kept - self->num_leaves + self->num_scratch) * sizeof(double);
+	const size_t leaves = 2 * (size_t)self->num_leaves * sizeof(double) + self->num_leaves * sizeof(Value *); // copies and pointers
+	printf("Segment: %d layers, Segments: %d, Kept: %d, Scratch: %d, Memory: %zuB(program %zuB + activations %zuB + leaves %zuB, graph %zuB), Extra FLOPs: %lld(+%.1f%%)\n",
+		   self->seg_len, self->num_segments, self->num_kept - self->num_leaves, self->num_scratch, self->program_bytes + activations + leaves,
+		   self->program_bytes, activations, leaves, self->graph_bytes, self->extra_flops, self->flops ? 100.0 * self->extra_flops / self->flops : 0);
+}
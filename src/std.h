@@ -37,16 +37,6 @@ double Std_random11(void) // returns number in range <-1, 1>
 	return value / 2147483647.0;
 }
 
-int Std_numberOfThreads(void)
-{
-	unsigned int ncores = 0, nthreads = 0;
-	asm volatile("cpuid"
-				 : "=a"(ncores), "=b"(nthreads)
-				 : "a"(0xb), "c"(0x1)
-				 :);
-	return nthreads;
-}
-
 int Std_bmin(const int a, const int b)
 {
 	return a < b ? a : b;
@@ -57,6 +47,121 @@ int Std_bmax(const int a, const int b)
 	return a > b ? a : b;
 }
 
+#define Std_MAX_CPUS 1024
+
+// CPUs which process can use(affinity mask at first call, so later pinning doesn't shrink it)
+const unsigned long long *_Std_cpuMask(void)
+{
+	static unsigned long long mask[Std_MAX_CPUS / 64];
+	static char done = 0;
+	if (!done)
+	{
+		if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) <= 0)
+		{
+			memset(mask, 0, sizeof(mask));
+			const int n = Std_bmin(Std_MAX_CPUS, sysconf(_SC_NPROCESSORS_ONLN));
+			for (int i = 0; i < n; i++)
+				mask[i / 64] |= 1ULL << (i % 64);
+		}
+		done = 1;
+	}
+	return mask;
+}
+
+// CPU limit of cgroup(v2 cpu.max or v1 cfs quota) rounded up, 0 = no limit
+int _Std_cgroupCpus(void)
+{
+	long long quota = -1, period = 0;
+
+	FILE *f = fopen("/sys/fs/cgroup/cpu.max", "r");
+	if (f)
+	{
+		if (fscanf(f, "%lld %lld", &quota, &period) != 2) // "max 100000" doesn't match
+			quota = -1;
+		fclose(f);
+	}
+	else if ((f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")))
+	{
+		if (fscanf(f, "%lld", &quota) != 1)
+			quota = -1;
+		fclose(f);
+
+		if ((f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")))
+		{
+			if (fscanf(f, "%lld", &period) != 1)
+				period = 0;
+			fclose(f);
+		}
+	}
+
+	return (quota > 0 && period > 0) ? (int)((quota + period - 1) / period) : 0;
+}
+
+// # of CPUs process can really use: affinity mask limited by cgroup quota
+int Std_numberOfThreads(void)
+{
+	static int n = 0;
+	if (!n)
+	{
+		const unsigned long long *mask = _Std_cpuMask();
+		for (int i = 0; i < Std_MAX_CPUS / 64; i++)
+			n += __builtin_popcountll(mask[i]);
+
+		const int quota = _Std_cgroupCpus();
+		if (quota)
+			n = Std_bmin(n, quota);
+		n = Std_bmax(1, n);
+	}
+	return n;
+}
+
+// 'i'-th CPU of affinity mask(wraps around)
+int Std_cpuOfIndex(int i)
+{
+	const unsigned long long *mask = _Std_cpuMask();
+	int num = 0;
+	for (int c = 0; c < Std_MAX_CPUS; c++)
+		num += (mask[c / 64] >> (c % 64)) & 1;
+	if (!num)
+		return 0;
+
+	i %= num;
+	for (int c = 0; c < Std_MAX_CPUS; c++)
+		if (((mask[c / 64] >> (c % 64)) & 1) && i-- == 0)
+			return c;
+	return 0;
+}
+
+// pins thread 'tid'(0 = calling thread) to 'cpu', -1 = unpins it(all CPUs of process)
+char Std_pinThread(const int tid, const int cpu)
+{
+	unsigned long long mask[Std_MAX_CPUS / 64];
+	if (cpu < 0)
+		memcpy(mask, _Std_cpuMask(), sizeof(mask));
+	else
+	{
+		memset(mask, 0, sizeof(mask));
+		mask[cpu / 64] = 1ULL << (cpu % 64);
+	}
+	return syscall(SYS_sched_setaffinity, tid, sizeof(mask), mask) == 0;
+}
+
+// id of calling thread for Std_pinThread()
+int Std_threadId(void)
+{
+	return syscall(SYS_gettid);
+}
+
+void Std_pause(void)
+{
+	asm volatile("pause");
+}
+
+void Std_yield(void)
+{
+	sched_yield();
+}
+
 void Std_sleep(const unsigned int ms)
 {
 #ifdef _WIN32
@@ -81,6 +186,18 @@ double Os_time(void)
 #endif
 }
 
+// monotonic time in seconds with ns resolution
+double Os_timeMono(void)
+{
+#ifdef _WIN32
+	return Os_time();
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + ((double)t.tv_nsec) / 1000000000;
+#endif
+}
+
 typedef struct StdThread_s
 {
 #ifdef WIN32
@@ -162,3 +279,91 @@ char OsSemaphore_wait(OsSemaphore *self)
 {
 	return sem_wait(self->sem) == 0;
 }
+
+// sense-reversing barrier. Threads spin for a while, then they sleep in futex
+typedef struct StdBarrier_s
+{
+	volatile int count; // # of threads which haven't arrived yet
+	volatile int sense; // flips when last thread arrives
+	volatile int num_sleepers;
+	int num_threads;
+	int spin; // # of spins before sleep
+} StdBarrier;
+
+void StdBarrier_init(StdBarrier *self, const int num_threads)
+{
+	self->count = num_threads;
+	self->sense = 0;
+	self->num_sleepers = 0;
+	self->num_threads = num_threads;
+	self->spin = (num_threads <= Std_numberOfThreads()) ? 20000 : 0; // spinning on oversubscribed CPU only steals time
+}
+
+// 'local_sense' is owned by calling thread and starts with 0
+void StdBarrier_wait(StdBarrier *self, int *local_sense)
+{
+	const int sense = !*local_sense;
+	*local_sense = sense;
+
+	if (__atomic_sub_fetch(&self->count, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		// last one releases others
+		self->count = self->num_threads;
+		__atomic_store_n(&self->sense, sense, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&self->num_sleepers, __ATOMIC_SEQ_CST))
+			syscall(SYS_futex, &self->sense, FUTEX_WAKE_PRIVATE, 0x7fffffff, 0, 0, 0);
+	}
+	else
+	{
+		for (int i = 0; i < self->spin; i++)
+		{
+			if (__atomic_load_n(&self->sense, __ATOMIC_ACQUIRE) == sense)
+				return;
+			Std_pause();
+		}
+
+		__atomic_add_fetch(&self->num_sleepers, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&self->sense, __ATOMIC_SEQ_CST) != sense)
+			syscall(SYS_futex, &self->sense, FUTEX_WAIT_PRIVATE, !sense, 0, 0, 0);
+		__atomic_sub_fetch(&self->num_sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+// file mapped read-only into memory, pages come from page cache
+typedef struct StdMap_s
+{
+	void *ptr;
+	size_t size;
+} StdMap;
+
+char StdMap_open(StdMap *self, const char *path)
+{
+	memset(self, 0, sizeof(StdMap));
+
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	void *ptr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // mapping keeps file open
+	if (ptr == MAP_FAILED)
+		return 0;
+
+	self->ptr = ptr;
+	self->size = st.st_size;
+	return 1;
+}
+
+void StdMap_free(StdMap *self)
+{
+	if (self->ptr)
+		munmap(self->ptr, self->size);
+	memset(self, 0, sizeof(StdMap));
+}
@@ -0,0 +1,726 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Tape is Topo compiled into flat arrays(structure-of-arrays) in execution order.
+// Nodes are addressed by 32-bit index instead of Value pointer, so forward/backward are linear scans.
+// Nodes can have 'batch' lanes(one per sample), so one graph processes whole minibatch.
+// Leaves(weights, constants) are shared by all lanes, only inputs and computed nodes have own lanes.
+typedef struct Tape_s
+{
+	Value **values; // source Values, values[i] <-> node i
+
+	int batch;
+	size_t *offsets;		// lane l of node i is data[offsets[i] + l * strides[i]]
+	unsigned char *strides; // 0 = shared by all lanes, 1 = every lane has own value
+	double *data;
+	double *grad;
+	size_t num_data; // size of data and grad
+	unsigned char *ops;
+	unsigned int *a; // index of 1st operand(n-ary: offset into 'args')
+	unsigned int *b; // index of 2nd operand(n-ary: num_args)
+	int num_nodes;
+
+	unsigned int *args; // operand indices of n-ary nodes
+	int num_args;
+
+	int *layers; // node range of layer i is <layers[i], layers[i + 1])
+	int num_layers;
+
+	unsigned int *roots; // nodes of Topo roots, they get grad 1
+	int num_roots;
+
+	// reverse edges, built by Tape_buildUsers()
+	unsigned int *users;		// nodes which read node i are users[user_offsets[i] .. user_offsets[i + 1]), one entry per operand
+	unsigned int *user_slots;	// position of node i in user's operands
+	unsigned int *user_offsets; // num_nodes + 1
+} Tape;
+
+// 'inputs' are leaves which get value per lane
+Tape *Tape_compileBatch(Topo *topo, const int batch, Value **inputs, const int num_inputs)
+{
+	Tape *self = malloc(sizeof(Tape));
+	self->num_nodes = Topo_numParameters(topo);
+	self->num_layers = topo->num_layers;
+	self->batch = batch;
+
+	self->values = malloc(self->num_nodes * sizeof(Value *));
+	self->offsets = malloc(self->num_nodes * sizeof(size_t));
+	self->strides = malloc(self->num_nodes * sizeof(unsigned char));
+	self->ops = malloc(self->num_nodes * sizeof(unsigned char));
+	self->a = malloc(self->num_nodes * sizeof(unsigned int));
+	self->b = malloc(self->num_nodes * sizeof(unsigned int));
+	self->layers = malloc((self->num_layers + 1) * sizeof(int));
+	self->users = 0;
+	self->user_slots = 0;
+	self->user_offsets = 0;
+
+	self->num_args = 0;
+	for (int i = 0; i < topo->num_layers; i++)
+	{
+		TopoLayer *layer = &topo->layers[i];
+		for (int ii = 0; ii < layer->num_values; ii++)
+		{
+			Value *v = layer->values[ii];
+			if (v->op == Value_OP_DOT || v->op == Value_OP_SUM)
+			{
+				int num;
+				Value_getPrevs(v, &num);
+				self->num_args += num;
+			}
+		}
+	}
+	self->args = malloc(self->num_args * sizeof(unsigned int));
+
+	// node i is Topo value with index i
+	Topo_buildIndex(topo);
+	char *is_input = malloc(Std_bmax(1, self->num_nodes));
+	memset(is_input, 0, self->num_nodes);
+	for (int i = 0; i < num_inputs; i++)
+		if (Topo_indexOf(topo, inputs[i]) >= 0)
+			is_input[Topo_indexOf(topo, inputs[i])] = 1;
+
+	int n = 0;
+	int n_args = 0;
+	size_t n_data = 0;
+	for (int i = 0; i < topo->num_layers; i++)
+	{
+		TopoLayer *layer = &topo->layers[i];
+		self->layers[i] = n;
+		for (int ii = 0; ii < layer->num_values; ii++)
+		{
+			Value *v = layer->values[ii];
+			self->values[n] = v;
+			self->strides[n] = (v->op != Value_OP_EMPTY || is_input[n]);
+			self->offsets[n] = n_data;
+			n_data += self->strides[n] ? batch : 1;
+			self->ops[n] = v->op;
+			if (v->op == Value_OP_DOT || v->op == Value_OP_SUM)
+			{
+				int num;
+				Value **prevs = Value_getPrevs(v, &num);
+				self->a[n] = n_args;
+				self->b[n] = v->num_args;
+				for (int p = 0; p < num; p++)
+					self->args[n_args++] = Topo_indexOf(topo, prevs[p]);
+			}
+			else
+			{
+				self->a[n] = v->prevs[0] ? Topo_indexOf(topo, v->prevs[0]) : 0;
+				self->b[n] = v->prevs[1] ? Topo_indexOf(topo, v->prevs[1]) : 0;
+			}
+			n++;
+		}
+	}
+	self->layers[self->num_layers] = n;
+
+	self->num_roots = topo->num_roots;
+	self->roots = malloc(Std_bmax(1, topo->num_roots) * sizeof(unsigned int));
+	for (int i = 0; i < topo->num_roots; i++)
+		self->roots[i] = Topo_indexOf(topo, topo->roots[i]);
+	free(is_input);
+
+	self->num_data = n_data;
+	self->data = malloc((n_data + 1) * sizeof(double));
+	self->grad = malloc((n_data + 1) * sizeof(double));
+	memset(self->grad, 0, n_data * sizeof(double));
+	for (int i = 0; i < n; i++)
+		for (int l = 0; l < (self->strides[i] ? batch : 1); l++)
+			self->data[self->offsets[i] + l] = self->values[i]->data;
+
+	return self;
+}
+
+Tape *Tape_compile(Topo *topo)
+{
+	return Tape_compileBatch(topo, 1, 0, 0);
+}
+
+void Tape_delete(Tape *self)
+{
+	free(self->values);
+	free(self->offsets);
+	free(self->strides);
+	free(self->data);
+	free(self->grad);
+	free(self->ops);
+	free(self->a);
+	free(self->b);
+	free(self->args);
+	free(self->layers);
+	free(self->roots);
+	free(self->users);
+	free(self->user_slots);
+	free(self->user_offsets);
+
+	memset(self, 0, sizeof(Tape));
+	free(self);
+}
+
+// returns operands of node i. 1-2 operands are copied into 'tmp', n-ary operands point into 'args'
+const unsigned int *Tape_getOperands(const Tape *self, const int i, unsigned int tmp[2], int *num)
+{
+	switch (self->ops[i])
+	{
+	case Value_OP_EMPTY:
+		*num = 0;
+		return tmp;
+	case Value_OP_NEG:
+	case Value_OP_TANH:
+	case Value_OP_RELU:
+		*num = 1;
+		tmp[0] = self->a[i];
+		return tmp;
+	case Value_OP_DOT:
+		*num = 2 * self->b[i];
+		return &self->args[self->a[i]];
+	case Value_OP_SUM:
+		*num = self->b[i];
+		return &self->args[self->a[i]];
+	default:
+		*num = 2;
+		tmp[0] = self->a[i];
+		tmp[1] = self->b[i];
+		return tmp;
+	}
+}
+
+void Tape_buildUsers(Tape *self)
+{
+	if (self->users)
+		return;
+
+	self->user_offsets = malloc((self->num_nodes + 1) * sizeof(unsigned int));
+	memset(self->user_offsets, 0, (self->num_nodes + 1) * sizeof(unsigned int));
+
+	// counts
+	unsigned int tmp[2];
+	int num;
+	for (int i = 0; i < self->num_nodes; i++)
+	{
+		const unsigned int *prevs = Tape_getOperands(self, i, tmp, &num);
+		for (int p = 0; p < num; p++)
+			self->user_offsets[prevs[p] + 1]++;
+	}
+	for (int i = 0; i < self->num_nodes; i++)
+		self->user_offsets[i + 1] += self->user_offsets[i];
+
+	// fills
+	unsigned int *pos = malloc(self->num_nodes * sizeof(unsigned int));
+	memcpy(pos, self->user_offsets, self->num_nodes * sizeof(unsigned int));
+	self->users = malloc(Std_bmax(1, self->user_offsets[self->num_nodes]) * sizeof(unsigned int));
+	self->user_slots = malloc(Std_bmax(1, self->user_offsets[self->num_nodes]) * sizeof(unsigned int));
+	for (int i = 0; i < self->num_nodes; i++)
+	{
+		const unsigned int *prevs = Tape_getOperands(self, i, tmp, &num);
+		for (int p = 0; p < num; p++)
+		{
+			self->user_slots[pos[prevs[p]]] = p;
+			self->users[pos[prevs[p]]++] = i;
+		}
+	}
+	free(pos);
+}
+
+double _Tape_dot(const double *data, const unsigned int *a, const unsigned int *b, const unsigned int n)
+{
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	unsigned int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		s0 += data[a[i + 0]] * data[b[i + 0]];
+		s1 += data[a[i + 1]] * data[b[i + 1]];
+		s2 += data[a[i + 2]] * data[b[i + 2]];
+		s3 += data[a[i + 3]] * data[b[i + 3]];
+	}
+	for (; i < n; i++)
+		s0 += data[a[i]] * data[b[i]];
+	return (s0 + s1) + (s2 + s3);
+}
+// same as _Value_dotGrad(), products of block first, then grads in operand order
+void _Tape_dotGrad(const double *data, double *grad, const unsigned int *a, const unsigned int *b, const unsigned int n, const double g)
+{
+	unsigned int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		const double ga0 = data[b[i + 0]] * g, ga1 = data[b[i + 1]] * g, ga2 = data[b[i + 2]] * g, ga3 = data[b[i + 3]] * g;
+		const double gb0 = data[a[i + 0]] * g, gb1 = data[a[i + 1]] * g, gb2 = data[a[i + 2]] * g, gb3 = data[a[i + 3]] * g;
+		grad[a[i + 0]] += ga0;
+		grad[b[i + 0]] += gb0;
+		grad[a[i + 1]] += ga1;
+		grad[b[i + 1]] += gb1;
+		grad[a[i + 2]] += ga2;
+		grad[b[i + 2]] += gb2;
+		grad[a[i + 3]] += ga3;
+		grad[b[i + 3]] += gb3;
+	}
+	for (; i < n; i++)
+	{
+		grad[a[i]] += data[b[i]] * g;
+		grad[b[i]] += data[a[i]] * g;
+	}
+}
+double _Tape_sum(const double *data, const unsigned int *a, const unsigned int n)
+{
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	unsigned int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		s0 += data[a[i + 0]];
+		s1 += data[a[i + 1]];
+		s2 += data[a[i + 2]];
+		s3 += data[a[i + 3]];
+	}
+	for (; i < n; i++)
+		s0 += data[a[i]];
+	return (s0 + s1) + (s2 + s3);
+}
+
+// copies leaves(inputs, weights) from Values into tape, inputs into all lanes
+void Tape_load(Tape *self)
+{
+	if (self->num_layers == 0)
+		return;
+
+	for (int i = 0; i < self->layers[1]; i++)
+		for (int l = 0; l < (self->strides[i] ? self->batch : 1); l++)
+			self->data[self->offsets[i] + l] = self->values[i]->data;
+}
+
+// copies data(lane 0) and grads(sum of lanes) from tape back into Values
+void Tape_store(Tape *self)
+{
+	for (int i = 0; i < self->num_nodes; i++)
+	{
+		double grad = 0;
+		for (int l = 0; l < (self->strides[i] ? self->batch : 1); l++)
+			grad += self->grad[self->offsets[i] + l];
+
+		self->values[i]->data = self->data[self->offsets[i]];
+		self->values[i]->grad = grad;
+	}
+}
+
+// returns node index of Value or -1
+int Tape_find(const Tape *self, const Value *v)
+{
+	for (int i = 0; i < self->num_nodes; i++)
+		if (self->values[i] == v)
+			return i;
+	return -1;
+}
+
+void Tape_setData(Tape *self, const int i, const int lane, const double data)
+{
+	self->data[self->offsets[i] + lane * self->strides[i]] = data;
+}
+double Tape_getData(const Tape *self, const int i, const int lane)
+{
+	return self->data[self->offsets[i] + lane * self->strides[i]];
+}
+double Tape_getGrad(const Tape *self, const int i, const int lane)
+{
+	return self->grad[self->offsets[i] + lane * self->strides[i]];
+}
+
+// out[l] += x[l * sx] * y[l * sy]. Shared operand(weight) is loaded once for all lanes
+void _Tape_lanesMulAdd(double *out, const double *x, const int sx, const double *y, const int sy, const int B)
+{
+	if (sx && sy)
+	{
+		for (int l = 0; l < B; l++)
+			out[l] += x[l] * y[l];
+	}
+	else if (sy)
+	{
+		const double xx = x[0];
+		for (int l = 0; l < B; l++)
+			out[l] += xx * y[l];
+	}
+	else if (sx)
+	{
+		const double yy = y[0];
+		for (int l = 0; l < B; l++)
+			out[l] += x[l] * yy;
+	}
+	else
+	{
+		const double xy = x[0] * y[0];
+		for (int l = 0; l < B; l++)
+			out[l] += xy;
+	}
+}
+
+// g[l * sg] += x[l * sx] * y[l]. Shared operand's grad is reduced over lanes
+void _Tape_lanesGradMulAdd(double *g, const int sg, const double *x, const int sx, const double *y, const int B)
+{
+	if (sg)
+	{
+		if (sx)
+		{
+			for (int l = 0; l < B; l++)
+				g[l] += x[l] * y[l];
+		}
+		else
+		{
+			const double xx = x[0];
+			for (int l = 0; l < B; l++)
+				g[l] += xx * y[l];
+		}
+	}
+	else
+	{
+		double sum = 0;
+		for (int l = 0; l < B; l++)
+			sum += x[l * sx] * y[l];
+		g[0] += sum;
+	}
+}
+
+void _Tape_forwardNodeN(Tape *self, const int i, const int B)
+{
+	double *data = self->data;
+	double *out = &data[self->offsets[i]];
+
+	const Value_OP op = self->ops[i];
+	if (op == Value_OP_DOT || op == Value_OP_SUM)
+	{
+		const unsigned int *aa = &self->args[self->a[i]];
+		const unsigned int n = self->b[i];
+
+		if (B == 1)
+		{
+			out[0] = (op == Value_OP_DOT) ? _Tape_dot(data, aa, aa + n, n) : _Tape_sum(data, aa, n);
+			return;
+		}
+
+		for (int l = 0; l < B; l++)
+			out[l] = 0;
+		for (unsigned int k = 0; k < n; k++)
+		{
+			const double *x = &data[self->offsets[aa[k]]];
+			if (op == Value_OP_DOT)
+			{
+				const double *y = &data[self->offsets[aa[k + n]]];
+				_Tape_lanesMulAdd(out, x, self->strides[aa[k]], y, self->strides[aa[k + n]], B);
+			}
+			else
+			{
+				const int sx = self->strides[aa[k]];
+				for (int l = 0; l < B; l++)
+					out[l] += x[l * sx];
+			}
+		}
+		return;
+	}
+
+	const double *x = &data[self->offsets[self->a[i]]];
+	const double *y = &data[self->offsets[self->b[i]]];
+	const int sx = self->strides[self->a[i]];
+	const int sy = self->strides[self->b[i]];
+	switch (op)
+	{
+	case Value_OP_ADD:
+		for (int l = 0; l < B; l++)
+			out[l] = x[l * sx] + y[l * sy];
+		break;
+	case Value_OP_SUB:
+		for (int l = 0; l < B; l++)
+			out[l] = x[l * sx] - y[l * sy];
+		break;
+	case Value_OP_MUL:
+		for (int l = 0; l < B; l++)
+			out[l] = x[l * sx] * y[l * sy];
+		break;
+	case Value_OP_DIV:
+		for (int l = 0; l < B; l++)
+			out[l] = x[l * sx] / y[l * sy];
+		break;
+	case Value_OP_POW_CONST:
+		for (int l = 0; l < B; l++)
+			out[l] = pow(x[l * sx], y[l * sy]);
+		break;
+	case Value_OP_NEG:
+		for (int l = 0; l < B; l++)
+			out[l] = x[l * sx] * -1;
+		break;
+	case Value_OP_TANH:
+		for (int l = 0; l < B; l++)
+		{
+			const double ex = exp(2 * x[l * sx]);
+			out[l] = (ex - 1) / (ex + 1);
+		}
+		break;
+	case Value_OP_RELU:
+		for (int l = 0; l < B; l++)
+			out[l] = (x[l * sx] < 0) ? 0.0 : x[l * sx];
+		break;
+	default:
+		break;
+	}
+}
+
+void Tape_forwardNode(Tape *self, const int i)
+{
+	// constant lane count lets compiler drop lane loops for single sample
+	if (self->batch == 1)
+		_Tape_forwardNodeN(self, i, 1);
+	else
+		_Tape_forwardNodeN(self, i, self->batch);
+}
+
+void Tape_forward(Tape *self)
+{
+	if (self->num_layers == 0)
+		return;
+
+	// layer 0 has only leaves
+	for (int i = self->layers[1]; i < self->num_nodes; i++)
+		Tape_forwardNode(self, i);
+}
+
+void Tape_resetGrads(Tape *self)
+{
+	// zero
+	memset(self->grad, 0, self->num_data * sizeof(double));
+
+	// one
+	for (int r = 0; r < self->num_roots; r++)
+	{
+		const unsigned int i = self->roots[r];
+		for (int l = 0; l < (self->strides[i] ? self->batch : 1); l++)
+			self->grad[self->offsets[i] + l] = 1;
+	}
+}
+
+void _Tape_backwardNodeN(Tape *self, const int i, const int B)
+{
+	const double *data = self->data;
+	double *grad = self->grad;
+	const double *out = &data[self->offsets[i]];
+	const double *g = &grad[self->offsets[i]];
+
+	const Value_OP op = self->ops[i];
+	if (op == Value_OP_DOT || op == Value_OP_SUM)
+	{
+		const unsigned int *aa = &self->args[self->a[i]];
+		const unsigned int n = self->b[i];
+
+		if (B == 1)
+		{
+			// single lane: offsets are node indices
+			if (op == Value_OP_DOT)
+				_Tape_dotGrad(data, grad, aa, aa + n, n, g[0]);
+			else
+				for (unsigned int k = 0; k < n; k++)
+					grad[aa[k]] += g[0];
+			return;
+		}
+
+		for (unsigned int k = 0; k < n; k++)
+		{
+			const unsigned int ka = aa[k];
+			if (op == Value_OP_DOT)
+			{
+				const unsigned int kb = aa[k + n];
+				_Tape_lanesGradMulAdd(&grad[self->offsets[ka]], self->strides[ka], &data[self->offsets[kb]], self->strides[kb], g, B);
+				_Tape_lanesGradMulAdd(&grad[self->offsets[kb]], self->strides[kb], &data[self->offsets[ka]], self->strides[ka], g, B);
+			}
+			else
+			{
+				double *gx = &grad[self->offsets[ka]];
+				const int sx = self->strides[ka];
+				for (int l = 0; l < B; l++)
+					gx[l * sx] += g[l];
+			}
+		}
+		return;
+	}
+
+	const double *x = &data[self->offsets[self->a[i]]];
+	const double *y = &data[self->offsets[self->b[i]]];
+	double *gx = &grad[self->offsets[self->a[i]]];
+	double *gy = &grad[self->offsets[self->b[i]]];
+	const int sx = self->strides[self->a[i]];
+	const int sy = self->strides[self->b[i]];
+	switch (op)
+	{
+	case Value_OP_ADD:
+		for (int l = 0; l < B; l++)
+		{
+			gx[l * sx] += g[l];
+			gy[l * sy] += g[l];
+		}
+		break;
+	case Value_OP_SUB:
+		for (int l = 0; l < B; l++)
+		{
+			gx[l * sx] += g[l];
+			gy[l * sy] -= g[l]; //-=
+		}
+		break;
+	case Value_OP_MUL:
+		for (int l = 0; l < B; l++)
+		{
+			gx[l * sx] += y[l * sy] * g[l];
+			gy[l * sy] += x[l * sx] * g[l];
+		}
+		break;
+	case Value_OP_DIV:
+		for (int l = 0; l < B; l++)
+		{
+			const double yy = y[l * sy];
+			gx[l * sx] += (1.0 / yy) * g[l];
+			gy[l * sy] -= (x[l * sx] / (yy * yy)) * g[l]; //-=
+		}
+		break;
+	case Value_OP_POW_CONST:
+		for (int l = 0; l < B; l++)
+			gx[l * sx] += y[l * sy] * pow(x[l * sx], y[l * sy] - 1) * g[l];
+		break;
+	case Value_OP_NEG:
+		for (int l = 0; l < B; l++)
+			gx[l * sx] -= g[l]; //-=
+		break;
+	case Value_OP_TANH:
+		for (int l = 0; l < B; l++)
+			gx[l * sx] += (1 - (out[l] * out[l])) * g[l];
+		break;
+	case Value_OP_RELU:
+		for (int l = 0; l < B; l++)
+			gx[l * sx] += (out[l] > 0.0) * g[l];
+		break;
+	default:
+		break;
+	}
+}
+
+void Tape_backwardNode(Tape *self, const int i)
+{
+	if (self->batch == 1)
+		_Tape_backwardNodeN(self, i, 1);
+	else
+		_Tape_backwardNodeN(self, i, self->batch);
+}
+
+void Tape_backward(Tape *self)
+{
+	if (self->num_layers == 0)
+		return;
+
+	for (int i = self->num_nodes - 1; i >= self->layers[1]; i--)
+		Tape_backwardNode(self, i);
+}
+
+// computes grad of node i from its users(Tape_buildUsers()), so only node i is written. Users must be done
+void _Tape_gatherNodeN(Tape *self, const int i, const int B)
+{
+	const double *data = self->data;
+	double *grad = self->grad;
+	double *gi = &grad[self->offsets[i]];
+	const int si = self->strides[i];
+
+	for (unsigned int e = self->user_offsets[i]; e < self->user_offsets[i + 1]; e++)
+	{
+		// users are computed nodes, so they always have own lanes
+		const unsigned int u = self->users[e];
+		const unsigned int slot = self->user_slots[e];
+		const double *gu = &grad[self->offsets[u]];
+		const double *out = &data[self->offsets[u]];
+		const unsigned int a = self->a[u];
+		const unsigned int b = self->b[u];
+
+		switch (self->ops[u])
+		{
+		case Value_OP_ADD:
+		case Value_OP_SUM:
+			for (int l = 0; l < B; l++)
+				gi[l * si] += gu[l];
+			break;
+		case Value_OP_SUB:
+			for (int l = 0; l < B; l++)
+				gi[l * si] += slot ? -gu[l] : gu[l];
+			break;
+		case Value_OP_NEG:
+			for (int l = 0; l < B; l++)
+				gi[l * si] -= gu[l];
+			break;
+		case Value_OP_MUL:
+		{
+			const unsigned int other = slot ? a : b;
+			_Tape_lanesGradMulAdd(gi, si, &data[self->offsets[other]], self->strides[other], gu, B);
+			break;
+		}
+		case Value_OP_DIV:
+		{
+			const double *x = &data[self->offsets[a]];
+			const double *y = &data[self->offsets[b]];
+			const int sx = self->strides[a];
+			const int sy = self->strides[b];
+			for (int l = 0; l < B; l++)
+			{
+				const double yy = y[l * sy];
+				gi[l * si] += (slot ? -(x[l * sx] / (yy * yy)) : (1.0 / yy)) * gu[l];
+			}
+			break;
+		}
+		case Value_OP_POW_CONST:
+			if (slot == 0)
+			{
+				const double *x = &data[self->offsets[a]];
+				const double *y = &data[self->offsets[b]];
+				const int sx = self->strides[a];
+				const int sy = self->strides[b];
+				for (int l = 0; l < B; l++)
+					gi[l * si] += y[l * sy] * pow(x[l * sx], y[l * sy] - 1) * gu[l];
+			}
+			break;
+		case Value_OP_TANH:
+			for (int l = 0; l < B; l++)
+				gi[l * si] += (1 - (out[l] * out[l])) * gu[l];
+			break;
+		case Value_OP_RELU:
+			for (int l = 0; l < B; l++)
+				gi[l * si] += (out[l] > 0.0) * gu[l];
+			break;
+		case Value_OP_DOT:
+		{
+			const unsigned int other = (slot < b) ? self->args[a + slot + b] : self->args[a + slot - b];
+			_Tape_lanesGradMulAdd(gi, si, &data[self->offsets[other]], self->strides[other], gu, B);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+}
+
+void Tape_gatherNode(Tape *self, const int i)
+{
+	if (self->batch == 1)
+		_Tape_gatherNodeN(self, i, 1);
+	else
+		_Tape_gatherNodeN(self, i, self->batch);
+}
+
+void Tape_run(Tape *self)
+{
+	if (self->num_layers == 0)
+		return;
+
+	Tape_forward(self);
+	Tape_resetGrads(self);
+	Tape_backward(self);
+}
@@ -14,57 +14,173 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+typedef struct TopoEdge_s
+{
+	Value *user;
+	int slot; // position in user's operands
+} TopoEdge;
+
+// entry of Value -> index hash, see Topo_buildIndex()
+typedef struct TopoIndexEntry_s
+{
+	const Value *v;
+	int i;
+} TopoIndexEntry;
+
 typedef struct TopoLayer_s
 {
 	Value **values;
 	int num_values;
+	int first; // index of values[0] in whole Topo
+
+	// TopoMT_plan(): # of threads(0 = caller only) and chunk size per direction
+	int fwd_threads, fwd_chunk;
+	int bwd_threads, bwd_chunk;
 } TopoLayer;
 
 typedef struct Topo_s
 {
 	TopoLayer *layers;
 	int num_layers;
+
+	Value **roots; // outputs, backward starts with grad 1 in all of them(gradient of their sum)
+	int num_roots;
+
+	// Value -> index(layers[l].first + position), built by Topo_buildIndex()
+	TopoIndexEntry *index;
+	unsigned int index_mask;
+
+	// reverse edges, built by Topo_buildUsers()
+	TopoEdge *users;   // users of value with index i are users[user_offsets[i] .. user_offsets[i + 1])
+	int *user_offsets; // # of values + 1
+
+	int plan_threads;  // layers are planned for TopoMT with this # of threads, 0 = not planned
+	int plan_backward; // TopoMT_BACKWARD of plan, gather and scatter have different costs
+	int plan_last_fwd;  // last parallel layer of forward, -1 = forward runs on caller
+	int plan_first_bwd; // last parallel layer of backward(lowest index), -1 = backward runs on caller
 } Topo;
 
-void _Topo_build(Topo *self, Value *v)
+typedef struct _TopoFrame_s
+{
+	Value *v;
+	int next; // next operand to visit
+} _TopoFrame;
+
+// one schedule for all 'roots'(e.g. per-sample losses). Shared values(weights) are there only once, so their grads are accumulated from all roots
+Topo *Topo_newMulti(Value **roots, const int num_roots)
 {
-	if (v && !v->visited)
+	Topo *self = malloc(sizeof(Topo));
+	self->layers = 0;
+	self->num_layers = 0;
+	self->roots = malloc(Std_bmax(1, num_roots) * sizeof(Value *));
+	self->num_roots = 0;
+	self->index = 0;
+	self->index_mask = 0;
+	self->users = 0;
+	self->user_offsets = 0;
+	self->plan_threads = 0;
+	self->plan_backward = 0;
+	self->plan_last_fwd = -1;
+	self->plan_first_bwd = -1;
+
+	// post-order DFS with explicit stack. Value is finished after all operands, so layer = 1 + max(operand layer)
+	Value **order = malloc(1024 * sizeof(Value *));
+	int num_order = 0, max_order = 1024;
+	_TopoFrame *stack = malloc(1024 * sizeof(_TopoFrame));
+	int num_stack = 0, max_stack = 1024;
+
+	for (int r = 0; r < num_roots; r++)
 	{
-		v->visited = 1;
-		_Topo_build(self, v->prevs[0]);
-		_Topo_build(self, v->prevs[1]);
+		if (!roots[r])
+			continue;
 
-		// add layer
-		if (v->layer >= self->num_layers)
-		{
-			int old_num_layers = self->num_layers;
-			self->num_layers = v->layer + 1;
-			self->layers = realloc(self->layers, self->num_layers * sizeof(TopoLayer));
-			memset(&self->layers[old_num_layers].values, 0, (self->num_layers - old_num_layers) * sizeof(TopoLayer));
-		}
-		// add value into layer
+		// root can be reachable from previous root, then it's already scheduled, but still gets grad 1
+		char dup = 0;
+		for (int i = 0; i < self->num_roots && roots[r]->visited; i++)
+			dup |= (self->roots[i] == roots[r]);
+		if (dup)
+			continue;
+		self->roots[self->num_roots++] = roots[r];
+		if (roots[r]->visited)
+			continue;
+
+		roots[r]->visited = 1;
+		stack[num_stack++] = (_TopoFrame){roots[r], 0};
+		while (num_stack)
 		{
-			TopoLayer *layer = &self->layers[v->layer];
-			layer->num_values++;
-			layer->values = realloc(layer->values, layer->num_values * sizeof(Value *));
-			layer->values[layer->num_values - 1] = v;
+			_TopoFrame *f = &stack[num_stack - 1];
+			Value *v = f->v;
+
+			int num;
+			Value **prevs = Value_getPrevs(v, &num);
+			while (f->next < num && (!prevs[f->next] || prevs[f->next]->visited))
+				f->next++;
+
+			if (f->next < num)
+			{
+				Value *p = prevs[f->next++];
+				p->visited = 1;
+
+				if (num_stack == max_stack)
+				{
+					max_stack *= 2;
+					stack = realloc(stack, max_stack * sizeof(_TopoFrame));
+				}
+				stack[num_stack++] = (_TopoFrame){p, 0};
+			}
+			else
+			{
+				unsigned int layer = 0;
+				for (int i = 0; i < num; i++)
+					if (prevs[i] && prevs[i]->layer + 1 > layer)
+						layer = prevs[i]->layer + 1;
+				v->layer = layer;
+				self->num_layers = Std_bmax(self->num_layers, layer + 1);
+
+				if (num_order == max_order)
+				{
+					max_order *= 2;
+					order = realloc(order, max_order * sizeof(Value *));
+				}
+				order[num_order++] = v;
+				num_stack--;
+			}
 		}
 	}
-}
 
-Topo *Topo_new(Value *result)
-{
-	Topo *self = malloc(sizeof(Topo));
-	self->layers = 0;
-	self->num_layers = 0;
+	// counts values per layer, so every layer is allocated only once
+	self->layers = malloc(self->num_layers * sizeof(TopoLayer));
+	memset(self->layers, 0, self->num_layers * sizeof(TopoLayer));
+	for (int i = 0; i < num_order; i++)
+		self->layers[order[i]->layer].num_values++;
+
+	int first = 0;
+	for (int i = 0; i < self->num_layers; i++)
+	{
+		self->layers[i].values = malloc(self->layers[i].num_values * sizeof(Value *));
+		self->layers[i].first = first;
+		first += self->layers[i].num_values;
+		self->layers[i].num_values = 0;
+	}
+
+	for (int i = 0; i < num_order; i++)
+	{
+		TopoLayer *layer = &self->layers[order[i]->layer];
+		layer->values[layer->num_values++] = order[i];
+		order[i]->visited = 0; // 'visited' is always 0 outside of Topo_new()
+	}
 
-	_Value_resetVisited(result);
-	_Value_updateDepth(result);
-	_Topo_build(self, result);
+	free(order);
+	free(stack);
 
 	return self;
 }
 
+Topo *Topo_new(Value *result)
+{
+	return Topo_newMulti(&result, 1);
+}
+
 void Topo_delete(Topo *self)
 {
 	for (int i = 0; i < self->num_layers; i++)
@@ -77,6 +193,11 @@ void Topo_delete(Topo *self)
 	memset(self->layers, 0, self->num_layers * sizeof(TopoLayer));
 	free(self->layers);
 
+	free(self->index);
+	free(self->users);
+	free(self->user_offsets);
+	free(self->roots);
+
 	memset(self, 0, sizeof(Topo));
 	free(self);
 }
@@ -89,6 +210,110 @@ int Topo_numParameters(Topo *self)
 	return n;
 }
 
+unsigned int _Topo_hashValue(const Value *v)
+{
+	return ((size_t)v * 11400714819323198485ULL) >> 32; // Fibonacci hashing
+}
+
+// Passes which number nodes look their operands up here. Values can be shared by more Topos(weights), so they aren't written
+void Topo_buildIndex(Topo *self)
+{
+	if (self->index)
+		return;
+
+	const int N = Topo_numParameters(self);
+	self->index_mask = 1024 - 1;
+	while (self->index_mask + 1 < 2 * (unsigned int)N)
+		self->index_mask = 2 * self->index_mask + 1;
+	self->index = malloc((self->index_mask + 1) * sizeof(TopoIndexEntry));
+	memset(self->index, 0, (self->index_mask + 1) * sizeof(TopoIndexEntry));
+
+	for (int i = 0; i < self->num_layers; i++)
+	{
+		TopoLayer *layer = &self->layers[i];
+		for (int ii = 0; ii < layer->num_values; ii++)
+		{
+			unsigned int h = _Topo_hashValue(layer->values[ii]) & self->index_mask;
+			while (self->index[h].v)
+				h = (h + 1) & self->index_mask;
+			self->index[h] = (TopoIndexEntry){layer->values[ii], layer->first + ii};
+		}
+	}
+}
+
+// index of 'v', -1 if it isn't in Topo. Topo_buildIndex() must be called before
+int Topo_indexOf(const Topo *self, const Value *v)
+{
+	unsigned int h = _Topo_hashValue(v) & self->index_mask;
+	while (self->index[h].v)
+	{
+		if (self->index[h].v == v)
+			return self->index[h].i;
+		h = (h + 1) & self->index_mask;
+	}
+	return -1;
+}
+
+void Topo_buildUsers(Topo *self)
+{
+	if (self->users)
+		return;
+
+	Topo_buildIndex(self);
+	const int N = Topo_numParameters(self);
+	self->user_offsets = malloc((N + 1) * sizeof(int));
+	memset(self->user_offsets, 0, (N + 1) * sizeof(int));
+
+	// counts
+	for (int i = 0; i < self->num_layers; i++)
+	{
+		TopoLayer *layer = &self->layers[i];
+		for (int ii = 0; ii < layer->num_values; ii++)
+		{
+			int num;
+			Value **prevs = Value_getPrevs(layer->values[ii], &num);
+			for (int p = 0; p < num; p++)
+				if (prevs[p])
+					self->user_offsets[Topo_indexOf(self, prevs[p]) + 1]++;
+		}
+	}
+	for (int i = 0; i < N; i++)
+		self->user_offsets[i + 1] += self->user_offsets[i];
+
+	// fills
+	int *pos = malloc(Std_bmax(1, N) * sizeof(int));
+	memcpy(pos, self->user_offsets, N * sizeof(int));
+	self->users = malloc(Std_bmax(1, self->user_offsets[N]) * sizeof(TopoEdge));
+	for (int i = 0; i < self->num_layers; i++)
+	{
+		TopoLayer *layer = &self->layers[i];
+		for (int ii = 0; ii < layer->num_values; ii++)
+		{
+			int num;
+			Value **prevs = Value_getPrevs(layer->values[ii], &num);
+			for (int p = 0; p < num; p++)
+				if (prevs[p])
+					self->users[pos[Topo_indexOf(self, prevs[p])]++] = (TopoEdge){layer->values[ii], p};
+		}
+	}
+	free(pos);
+}
+
+// computes grad of value from its users, so only value itself is written. Users must be done
+void Topo_gather(Topo *self, const int i_layer, const int i_value)
+{
+	TopoLayer *layer = &self->layers[i_layer];
+	const int i = layer->first + i_value;
+
+	double grad = 0;
+	for (int u = self->user_offsets[i]; u < self->user_offsets[i + 1]; u++)
+	{
+		const TopoEdge *e = &self->users[u];
+		grad += Value_partial(e->user, e->slot) * e->user->grad;
+	}
+	layer->values[i_value]->grad += grad;
+}
+
 void Topo_resetGrads(Topo *self)
 {
 	// zero
@@ -99,32 +324,38 @@ void Topo_resetGrads(Topo *self)
 			layer->values[i]->grad = 0;
 	}
 
-	// one
-	if (self->num_layers)
+	// one, d(sum of roots)/d(root)
+	for (int i = 0; i < self->num_roots; i++)
+		self->roots[i]->grad = 1;
+}
+
+// resets grads of computed values only, leaves(weights) keep accumulating grads from more runs(microbatches)
+void Topo_resetInnerGrads(Topo *self)
+{
+	for (int i = 1; i < self->num_layers; i++)
 	{
-		TopoLayer *layer = &self->layers[self->num_layers - 1];
-		for (int i = 0; i < layer->num_values; i++)
-			layer->values[i]->grad = 1;
+		TopoLayer *layer = &self->layers[i];
+		for (int ii = 0; ii < layer->num_values; ii++)
+			layer->values[ii]->grad = 0;
 	}
+
+	for (int i = 0; i < self->num_roots; i++)
+		self->roots[i]->grad = 1;
 }
 
-void Topo_run(Topo *self)
+void Topo_forward(Topo *self)
 {
-	if (self->num_layers == 0)
-		return;
-
-	// forward
 	for (int i = 0; i < self->num_layers; i++)
 	{
 		TopoLayer *layer = &self->layers[i];
 		for (int ii = 0; ii < layer->num_values; ii++)
 			Value_forward(layer->values[ii]);
 	}
+}
 
-	// reset grads
-	Topo_resetGrads(self);
-
-	// backward
+// propagates grads from last layer, grads must be reset before
+void Topo_backprop(Topo *self)
+{
 	for (int i = self->num_layers - 1; i >= 0; i--)
 	{
 		TopoLayer *layer = &self->layers[i];
@@ -133,6 +364,23 @@ void Topo_run(Topo *self)
 	}
 }
 
+// resets grads and propagates them from last layer
+void Topo_backward(Topo *self)
+{
+	Topo_resetGrads(self);
+	Topo_backprop(self);
+}
+
+void Topo_run(Topo *self)
+{
+	if (self->num_layers == 0)
+		return;
+
+	Topo_forward(self);
+	Topo_backward(self);
+}
+
+// updates every Value including inputs and constants, training should use ParamStore_update()
 void Topo_update(Topo *self, const double val)
 {
 	for (int i = 0; i < self->num_layers; i++)
@@ -0,0 +1,390 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// TopoDF executes Tape as dataflow: node runs as soon as its operands are done, there are no layer barriers.
+// Ready nodes are kept in per-thread Chase-Lev deques, idle threads steal from others.
+
+#define TopoDeque_EMPTY 0xffffffff
+#define TopoDeque_ABORT 0xfffffffe
+
+typedef struct TopoDequeBuf_s
+{
+	long size; // power of 2
+	unsigned int *items;
+	struct TopoDequeBuf_s *prev; // smaller buffer which was replaced(stealers can still read it)
+} TopoDequeBuf;
+
+// owner pushes/takes at bottom, other threads steal from top
+typedef struct TopoDeque_s
+{
+	volatile long top;
+	volatile long bottom;
+	TopoDequeBuf *volatile buf;
+} TopoDeque;
+
+TopoDequeBuf *_TopoDequeBuf_new(const long size, TopoDequeBuf *prev)
+{
+	TopoDequeBuf *self = malloc(sizeof(TopoDequeBuf));
+	self->size = size;
+	self->items = malloc(size * sizeof(unsigned int));
+	self->prev = prev;
+	return self;
+}
+
+void TopoDeque_init(TopoDeque *self)
+{
+	self->top = 0;
+	self->bottom = 0;
+	self->buf = _TopoDequeBuf_new(1024, 0);
+}
+
+void TopoDeque_free(TopoDeque *self)
+{
+	TopoDequeBuf *buf = self->buf;
+	while (buf)
+	{
+		TopoDequeBuf *prev = buf->prev;
+		free(buf->items);
+		free(buf);
+		buf = prev;
+	}
+	memset(self, 0, sizeof(TopoDeque));
+}
+
+void TopoDeque_push(TopoDeque *self, const unsigned int x)
+{
+	const long b = __atomic_load_n(&self->bottom, __ATOMIC_RELAXED);
+	const long t = __atomic_load_n(&self->top, __ATOMIC_ACQUIRE);
+	TopoDequeBuf *buf = __atomic_load_n(&self->buf, __ATOMIC_RELAXED);
+
+	if (b - t > buf->size - 1)
+	{
+		// grows
+		TopoDequeBuf *nbuf = _TopoDequeBuf_new(buf->size * 2, buf);
+		for (long i = t; i < b; i++)
+			nbuf->items[i & (nbuf->size - 1)] = buf->items[i & (buf->size - 1)];
+		__atomic_store_n(&self->buf, nbuf, __ATOMIC_RELEASE);
+		buf = nbuf;
+	}
+
+	__atomic_store_n(&buf->items[b & (buf->size - 1)], x, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&self->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+unsigned int TopoDeque_take(TopoDeque *self)
+{
+	const long b = __atomic_load_n(&self->bottom, __ATOMIC_RELAXED) - 1;
+	TopoDequeBuf *buf = __atomic_load_n(&self->buf, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long t = __atomic_load_n(&self->top, __ATOMIC_RELAXED);
+
+	unsigned int x = TopoDeque_EMPTY;
+	if (t <= b)
+	{
+		x = __atomic_load_n(&buf->items[b & (buf->size - 1)], __ATOMIC_RELAXED);
+		if (t == b)
+		{
+			// last item, races with stealers
+			if (!__atomic_compare_exchange_n(&self->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				x = TopoDeque_EMPTY;
+			__atomic_store_n(&self->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	}
+	else
+		__atomic_store_n(&self->bottom, b + 1, __ATOMIC_RELAXED);
+	return x;
+}
+
+unsigned int TopoDeque_steal(TopoDeque *self)
+{
+	long t = __atomic_load_n(&self->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	const long b = __atomic_load_n(&self->bottom, __ATOMIC_ACQUIRE);
+
+	if (t < b)
+	{
+		TopoDequeBuf *buf = __atomic_load_n(&self->buf, __ATOMIC_ACQUIRE);
+		const unsigned int x = __atomic_load_n(&buf->items[t & (buf->size - 1)], __ATOMIC_RELAXED);
+		if (!__atomic_compare_exchange_n(&self->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return TopoDeque_ABORT; // other thread was faster
+		return x;
+	}
+	return TopoDeque_EMPTY;
+}
+
+typedef struct TopoDF_s TopoDF;
+typedef struct TopoDFThread_s
+{
+	TopoDF *parent;
+	int i_thread;
+
+	StdThread thread;
+
+	TopoDeque deque;
+	unsigned int rnd; // picks victim for stealing
+	int sense;
+} TopoDFThread;
+
+typedef struct TopoDF_s
+{
+	Tape *tape;
+
+	TopoDFThread **threads; // #0 is caller
+	int num_threads;
+
+	StdBarrier barrier;
+	volatile int exit;
+	volatile int backward; // current pass
+	volatile long remaining; // # of nodes which didn't run in current pass yet
+
+	int *pending;	// # of operands(forward) or users(backward) which aren't done
+	int *pending_f; // initial forward counters
+	int *pending_b; // initial backward counters
+
+	unsigned int *seeds_f; // nodes without computed operands
+	int num_seeds_f;
+	unsigned int *seeds_b; // nodes without users(leaves included)
+	int num_seeds_b;
+} TopoDF;
+
+void _TopoDF_runNode(TopoDF *self, TopoDFThread *th, const unsigned int x)
+{
+	Tape *tape = self->tape;
+
+	if (!self->backward)
+	{
+		Tape_forwardNode(tape, x);
+
+		// users can run when all their operands are done
+		for (unsigned int u = tape->user_offsets[x]; u < tape->user_offsets[x + 1]; u++)
+		{
+			const unsigned int user = tape->users[u];
+			if (__atomic_sub_fetch(&self->pending[user], 1, __ATOMIC_ACQ_REL) == 0)
+				TopoDeque_push(&th->deque, user);
+		}
+	}
+	else
+	{
+		// grad is gathered from users, so no other thread writes it
+		Tape_gatherNode(tape, x);
+
+		// operand can run when all its users are done
+		unsigned int tmp[2];
+		int num;
+		const unsigned int *prevs = Tape_getOperands(tape, x, tmp, &num);
+		for (int p = 0; p < num; p++)
+			if (__atomic_sub_fetch(&self->pending[prevs[p]], 1, __ATOMIC_ACQ_REL) == 0)
+				TopoDeque_push(&th->deque, prevs[p]);
+	}
+}
+
+unsigned int _TopoDF_steal(TopoDF *self, TopoDFThread *th)
+{
+	// xorshift
+	th->rnd ^= th->rnd << 13;
+	th->rnd ^= th->rnd >> 17;
+	th->rnd ^= th->rnd << 5;
+
+	const int victim = th->rnd % self->num_threads;
+	if (victim == th->i_thread)
+		return TopoDeque_EMPTY;
+	return TopoDeque_steal(&self->threads[victim]->deque);
+}
+
+void _TopoDF_runPass(TopoDF *self, TopoDFThread *th)
+{
+	long done = 0; // not subtracted from 'remaining' yet
+	int fails = 0;
+	while (__atomic_load_n(&self->remaining, __ATOMIC_ACQUIRE) > 0)
+	{
+		unsigned int x = TopoDeque_take(&th->deque);
+		if (x == TopoDeque_EMPTY)
+		{
+			if (done)
+			{
+				__atomic_sub_fetch(&self->remaining, done, __ATOMIC_ACQ_REL);
+				done = 0;
+			}
+
+			x = _TopoDF_steal(self, th);
+			if (x == TopoDeque_EMPTY || x == TopoDeque_ABORT)
+			{
+				if (++fails > 64)
+					Std_yield();
+				else
+					Std_pause();
+				continue;
+			}
+		}
+
+		fails = 0;
+		_TopoDF_runNode(self, th, x);
+		if (++done == 256)
+		{
+			__atomic_sub_fetch(&self->remaining, done, __ATOMIC_ACQ_REL);
+			done = 0;
+		}
+	}
+}
+
+// called by one thread, while others wait in barrier
+void _TopoDF_seed(TopoDF *self, const int backward)
+{
+	Tape *tape = self->tape;
+
+	self->backward = backward;
+	self->remaining = backward ? tape->num_nodes : tape->num_nodes - tape->layers[1]; // leaves gather grads too
+	memcpy(self->pending, backward ? self->pending_b : self->pending_f, tape->num_nodes * sizeof(int));
+
+	const unsigned int *seeds = backward ? self->seeds_b : self->seeds_f;
+	const int num_seeds = backward ? self->num_seeds_b : self->num_seeds_f;
+	for (int i = 0; i < num_seeds; i++)
+		TopoDeque_push(&self->threads[i % self->num_threads]->deque, seeds[i]);
+}
+
+void _TopoDF_runThread(TopoDF *self, TopoDFThread *th)
+{
+	// forward
+	_TopoDF_runPass(self, th);
+	StdBarrier_wait(&self->barrier, &th->sense);
+
+	// resets grads
+	if (th->i_thread == 0)
+	{
+		Tape_resetGrads(self->tape);
+		_TopoDF_seed(self, 1);
+	}
+	StdBarrier_wait(&self->barrier, &th->sense);
+
+	// backward
+	_TopoDF_runPass(self, th);
+	StdBarrier_wait(&self->barrier, &th->sense);
+}
+
+StdThread_FUNC(TopoDFThread_loop, arg)
+{
+	TopoDFThread *self = arg;
+	while (1)
+	{
+		StdBarrier_wait(&self->parent->barrier, &self->sense); // waits for TopoDF_run()
+		if (self->parent->exit)
+			break;
+		_TopoDF_runThread(self->parent, self);
+	}
+	return 0;
+}
+
+TopoDFThread *TopoDFThread_new(TopoDF *parent, const int i_thread)
+{
+	TopoDFThread *self = malloc(sizeof(TopoDFThread));
+	self->parent = parent;
+	self->i_thread = i_thread;
+	TopoDeque_init(&self->deque);
+	self->rnd = 2463534242u + i_thread * 7919;
+	self->sense = 0;
+
+	memset(&self->thread, 0, sizeof(StdThread));
+	if (i_thread) // caller is #0
+		StdThread_init(&self->thread, "TopoDFThread", &TopoDFThread_loop, self);
+
+	return self;
+}
+
+void TopoDFThread_delete(TopoDFThread *self)
+{
+	StdThread_free(&self->thread);
+	TopoDeque_free(&self->deque);
+
+	memset(self, 0, sizeof(TopoDFThread));
+	free(self);
+}
+
+TopoDF *TopoDF_new(Tape *tape, int num_threads)
+{
+	TopoDF *self = malloc(sizeof(TopoDF));
+	self->tape = tape;
+	self->num_threads = (num_threads <= 0) ? Std_numberOfThreads() : num_threads;
+
+	Tape_buildUsers(tape);
+
+	// initial counters
+	const int N = tape->num_nodes;
+	const int num_leaves = tape->num_layers ? tape->layers[1] : N;
+	self->pending = malloc(N * sizeof(int));
+	self->pending_f = malloc(N * sizeof(int));
+	self->pending_b = malloc(N * sizeof(int));
+	self->seeds_f = malloc(N * sizeof(unsigned int));
+	self->seeds_b = malloc(N * sizeof(unsigned int));
+	self->num_seeds_f = 0;
+	self->num_seeds_b = 0;
+	for (int i = 0; i < N; i++)
+	{
+		unsigned int tmp[2];
+		int num;
+		const unsigned int *prevs = Tape_getOperands(tape, i, tmp, &num);
+
+		self->pending_f[i] = 0;
+		for (int p = 0; p < num; p++)
+			self->pending_f[i] += (prevs[p] >= (unsigned int)num_leaves);
+		self->pending_b[i] = tape->user_offsets[i + 1] - tape->user_offsets[i];
+
+		if (i >= num_leaves && self->pending_f[i] == 0)
+			self->seeds_f[self->num_seeds_f++] = i;
+		if (self->pending_b[i] == 0)
+			self->seeds_b[self->num_seeds_b++] = i;
+	}
+
+	StdBarrier_init(&self->barrier, self->num_threads);
+	self->exit = 0;
+	self->backward = 0;
+	self->remaining = 0;
+
+	self->threads = malloc(self->num_threads * sizeof(TopoDFThread *));
+	for (int i = 0; i < self->num_threads; i++)
+		self->threads[i] = TopoDFThread_new(self, i);
+	return self;
+}
+
+void TopoDF_delete(TopoDF *self)
+{
+	self->exit = 1;
+	StdBarrier_wait(&self->barrier, &self->threads[0]->sense); // releases workers
+
+	for (int i = 0; i < self->num_threads; i++)
+		TopoDFThread_delete(self->threads[i]);
+	free(self->threads);
+
+	free(self->pending);
+	free(self->pending_f);
+	free(self->pending_b);
+	free(self->seeds_f);
+	free(self->seeds_b);
+
+	memset(self, 0, sizeof(TopoDF));
+	free(self);
+}
+
+void TopoDF_run(TopoDF *self)
+{
+	if (self->tape->num_layers == 0)
+		return;
+
+	_TopoDF_seed(self, 0);
+	StdBarrier_wait(&self->barrier, &self->threads[0]->sense); // starts workers
+	_TopoDF_runThread(self, self->threads[0]);
+}
@@ -14,6 +14,28 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+typedef enum
+{
+	TopoMT_SCHED_SEMAPHORE, // every layer is sent to every thread with semaphores
+	TopoMT_SCHED_BARRIER,	// all threads walk layers together, layers are separated with barrier
+} TopoMT_SCHED;
+
+typedef enum
+{
+	TopoMT_BACKWARD_GATHER,	 // value sums grad from its users. Every value is written by one thread only
+	TopoMT_BACKWARD_SCATTER, // value adds grad into its operands. Threads race on shared operands!
+} TopoMT_BACKWARD;
+
+typedef enum
+{
+	TopoMT_PHASE_FORWARD = 1,
+	TopoMT_PHASE_RESET = 2, // grads reset
+	TopoMT_PHASE_BACKWARD = 4,
+	TopoMT_PHASE_RESET_INNER = 8, // grads reset without leaves, they accumulate
+} TopoMT_PHASE;
+
+#define TopoMT_CHUNK_NS 200 // min. work taken from shared cursor at once
+
 typedef struct TopoMT_s TopoMT;
 typedef struct TopoThread_s
 {
@@ -21,12 +43,16 @@ typedef struct TopoThread_s
 	int i_thread;
 
 	StdThread thread;
+	volatile int tid; // for pinning, set by thread when it starts
 
 	OsSemaphore semaphore_new_work;
 	OsSemaphore semaphore_work_done;
 
 	volatile int forward_layer;
 	volatile int backward_layer;
+	int num_split; // # of threads which share layer
+
+	int sense; // TopoMT_SCHED_BARRIER
 } TopoThread;
 
 typedef struct TopoMT_s
@@ -35,9 +61,30 @@ typedef struct TopoMT_s
 
 	TopoThread **threads;
 	int num_threads;
+
+	TopoMT_SCHED sched;
+	TopoMT_BACKWARD backward;
+
+	// TopoMT_SCHED_BARRIER
+	StdBarrier barrier;
+	int sense;				// caller's side
+	volatile int exit;		// workers leave after next start barrier
+	volatile int cursor[2]; // next value in current layer. Layers alternate cursors, so one can be reset while other is used
+	int phases;				// TopoMT_PHASE mask of current run
+
+	Trace *trace; // 0 = off
+	char pin;	  // TopoMT_setPinning()
+
+	double sync_ns; // measured cost of barrier(or semaphore round trip), layer must give every thread more work than this
+
+	// TopoMT_parallelFor()
+	void (*job_func)(void *prm, int st, int en);
+	void *job_prm;
+	int job_n;
 } TopoMT;
 
 StdThread_FUNC(TopoThread_loop, arg);
+void _TopoMT_measureSync(TopoMT *self);
 TopoThread *TopoThread_new(TopoMT *parent, const int i_thread)
 {
 	TopoThread *self = malloc(sizeof(TopoThread));
@@ -47,6 +94,12 @@ TopoThread *TopoThread_new(TopoMT *parent, const int i_thread)
 	OsSemaphore_init(&self->semaphore_new_work);
 	OsSemaphore_init(&self->semaphore_work_done);
 
+	self->forward_layer = -1;
+	self->backward_layer = -1;
+	self->num_split = 1;
+	self->sense = 0;
+	self->tid = 0;
+
 	StdThread_init(&self->thread, "TopoThread", &TopoThread_loop, self);
 
 	return self;
@@ -54,7 +107,8 @@ TopoThread *TopoThread_new(TopoMT *parent, const int i_thread)
 void TopoThread_delete(TopoThread *self)
 {
 	self->thread.run = 0;
-	OsSemaphore_trigger(&self->semaphore_new_work);
+	if (self->parent->sched == TopoMT_SCHED_SEMAPHORE)
+		OsSemaphore_trigger(&self->semaphore_new_work);
 	StdThread_free(&self->thread);
 
 	OsSemaphore_free(&self->semaphore_new_work);
@@ -64,15 +118,287 @@ void TopoThread_delete(TopoThread *self)
 	free(self);
 }
 
+void _TopoMT_backwardRange(TopoMT *self, const int i_layer, const int st, const int en)
+{
+	TopoLayer *layer = &self->topo->layers[i_layer];
+	if (self->backward == TopoMT_BACKWARD_GATHER)
+	{
+		for (int i = st; i < en; i++)
+			Topo_gather(self->topo, i_layer, i);
+	}
+	else
+	{
+		for (int i = st; i < en; i++)
+			Value_backward(layer->values[i]);
+	}
+}
+
+// waits for other threads, with trace on it records work since 'time' and barrier wait
+void _TopoMT_barrier(TopoMT *self, const int i_thread, int *sense, const Trace_KIND kind, const int layer, const double time)
+{
+	Trace *trace = self->trace;
+	if (!trace)
+	{
+		StdBarrier_wait(&self->barrier, sense);
+		return;
+	}
+
+	const double en = Os_timeMono();
+	Trace_add(trace, i_thread, kind, layer, time, en);
+	StdBarrier_wait(&self->barrier, sense);
+	Trace_add(trace, i_thread, Trace_WAIT, layer, en, Os_timeMono());
+}
+
+// plans how layer is split: threads must get more work than sync costs, narrow layers run on caller only
+void _TopoMT_planLayer(TopoMT *self, Topo *topo, TopoLayer *layer, const char backward, int *threads, int *chunk)
+{
+	const TopoCost *cost = TopoCost_get();
+	double ns = 0;
+	if (backward && self->backward == TopoMT_BACKWARD_GATHER)
+	{
+		// value pays for its users, so leaves(weights) are often most expensive
+		for (int i = 0; i < layer->num_values; i++)
+			ns += TopoCost_gather(cost, topo, layer->first + i);
+	}
+	else
+	{
+		for (int i = 0; i < layer->num_values; i++)
+			ns += TopoCost_value(cost, layer->values[i], backward);
+	}
+
+	const int n = layer->num_values;
+	const int t = Std_bmin(Std_bmin(self->num_threads, n), (int)(ns / fmax(1, self->sync_ns)));
+	if (t <= 1)
+	{
+		*threads = 0;
+		*chunk = n;
+		return;
+	}
+
+	// ~4 chunks per thread for balance, but chunk must be worth its atomic
+	const double value_ns = fmax(0.1, ns / n);
+	const int c = Std_bmax(n / (t * 4), (int)(TopoMT_CHUNK_NS / value_ns) + 1);
+	*threads = t;
+	*chunk = Std_bmax(1, Std_bmin(n, c));
+}
+
+// decides for every layer if it runs on caller or on how many threads and with what chunk
+void TopoMT_plan(TopoMT *self, Topo *topo)
+{
+	if (self->backward == TopoMT_BACKWARD_GATHER)
+		Topo_buildUsers(topo);
+
+	topo->plan_last_fwd = -1;
+	topo->plan_first_bwd = -1;
+	for (int i = 0; i < topo->num_layers; i++)
+	{
+		TopoLayer *layer = &topo->layers[i];
+		_TopoMT_planLayer(self, topo, layer, 0, &layer->fwd_threads, &layer->fwd_chunk);
+		_TopoMT_planLayer(self, topo, layer, 1, &layer->bwd_threads, &layer->bwd_chunk);
+		if (layer->fwd_threads)
+			topo->plan_last_fwd = i;
+		if (layer->bwd_threads && topo->plan_first_bwd < 0)
+			topo->plan_first_bwd = i;
+	}
+	topo->plan_threads = self->num_threads;
+	topo->plan_backward = self->backward;
+}
+
+// plan depends on # of threads and backward mode
+char TopoMT_isPlanned(const TopoMT *self, const Topo *topo)
+{
+	return topo->plan_threads == self->num_threads && topo->plan_backward == (int)self->backward;
+}
+
+// # of serial(caller only) and parallel layers of plan
+void TopoMT_printPlan(Topo *topo)
+{
+	int fwd = 0, bwd = 0;
+	for (int i = 0; i < topo->num_layers; i++)
+	{
+		fwd += topo->layers[i].fwd_threads > 0;
+		bwd += topo->layers[i].bwd_threads > 0;
+	}
+	printf("Layers: %d, parallel forward: %d, parallel backward: %d\n", topo->num_layers, fwd, bwd);
+}
+
+// waits for work of thread #0 which didn't have barrier yet
+void _TopoMT_sync(TopoMT *self, const int i_thread, int *sense, const int layer)
+{
+	const double time = self->trace ? Os_timeMono() : 0;
+	StdBarrier_wait(&self->barrier, sense);
+	if (self->trace)
+		Trace_add(self->trace, i_thread, Trace_WAIT, layer, time, Os_timeMono());
+}
+
+// every thread(caller is #0) executes all layers of 'phases'. Values are taken in chunks from shared cursor.
+// Serial layers(and reset) are run by thread #0 only and there is no barrier until next parallel layer
+void _TopoMT_runShared(TopoMT *self, const int i_thread, int *sense)
+{
+	// caller can't change them until this thread reaches 1st barrier. Without trace, workers leave after their last barrier,
+	// so they never read topo while caller runs serial tail and returns
+	Topo *topo = self->topo;
+	Trace *trace = self->trace;
+	const int phases = self->phases;
+	const int num_layers = topo->num_layers;
+	const char leave = (i_thread != 0 && !trace);
+	const int last_fwd = (phases & TopoMT_PHASE_FORWARD) ? topo->plan_last_fwd : -1;
+	const int first_bwd = (phases & TopoMT_PHASE_BACKWARD) ? topo->plan_first_bwd : -1;
+	int c = 0;
+	char pending = 0; // thread #0 did serial work, others haven't waited for it
+
+	if (leave && last_fwd < 0 && first_bwd < 0)
+		return;
+
+	// forward
+	for (int i = 0; (phases & TopoMT_PHASE_FORWARD); i++)
+	{
+		// exit is tested before topo is touched, caller can delete it after serial tail
+		if (leave && i > last_fwd)
+		{
+			pending = 1; // serial rest of forward is done by thread #0
+			break;
+		}
+		if (i >= num_layers)
+			break;
+		TopoLayer *layer = &topo->layers[i];
+		if (layer->fwd_threads == 0)
+		{
+			if (i_thread == 0)
+			{
+				const double time = trace ? Os_timeMono() : 0;
+				for (int ii = 0; ii < layer->num_values; ii++)
+					Value_forward(layer->values[ii]);
+				if (trace)
+					Trace_add(trace, 0, Trace_FORWARD, i, time, Os_timeMono());
+			}
+			pending = 1;
+			continue;
+		}
+
+		if (pending)
+			_TopoMT_sync(self, i_thread, sense, i);
+		pending = 0;
+
+		const double time = trace ? Os_timeMono() : 0;
+		if (i_thread == 0)
+			self->cursor[c ^ 1] = 0; // was used by previous parallel layer, which is done
+
+		int st;
+		const int chunk = layer->fwd_chunk;
+		while (i_thread < layer->fwd_threads && (st = __atomic_fetch_add(&self->cursor[c], chunk, __ATOMIC_RELAXED)) < layer->num_values)
+		{
+			const int en = Std_bmin(layer->num_values, st + chunk);
+			for (int ii = st; ii < en; ii++)
+				Value_forward(layer->values[ii]);
+		}
+		_TopoMT_barrier(self, i_thread, sense, Trace_FORWARD, i, time);
+		c ^= 1;
+	}
+
+	if (leave && first_bwd < 0)
+		return;
+
+	// resets grads
+	if (phases & (TopoMT_PHASE_RESET | TopoMT_PHASE_RESET_INNER))
+	{
+		if (i_thread == 0)
+		{
+			const double time = trace ? Os_timeMono() : 0;
+			if (phases & TopoMT_PHASE_RESET)
+				Topo_resetGrads(topo);
+			else
+				Topo_resetInnerGrads(topo);
+			if (trace)
+				Trace_add(trace, 0, Trace_RESET, num_layers - 1, time, Os_timeMono());
+		}
+		pending = 1;
+	}
+
+	// backward
+	for (int i = num_layers - 1; i >= 0 && (phases & TopoMT_PHASE_BACKWARD); i--)
+	{
+		if (leave && i < first_bwd)
+			break; // serial rest of backward
+		TopoLayer *layer = &topo->layers[i];
+		if (layer->bwd_threads == 0)
+		{
+			if (i_thread == 0)
+			{
+				const double time = trace ? Os_timeMono() : 0;
+				_TopoMT_backwardRange(self, i, 0, layer->num_values);
+				if (trace)
+					Trace_add(trace, 0, Trace_BACKWARD, i, time, Os_timeMono());
+			}
+			pending = 1;
+			continue;
+		}
+
+		if (pending)
+			_TopoMT_sync(self, i_thread, sense, i);
+		pending = 0;
+
+		const double time = trace ? Os_timeMono() : 0;
+		if (i_thread == 0)
+			self->cursor[c ^ 1] = 0;
+
+		int st;
+		const int chunk = layer->bwd_chunk;
+		while (i_thread < layer->bwd_threads && (st = __atomic_fetch_add(&self->cursor[c], chunk, __ATOMIC_RELAXED)) < layer->num_values)
+		{
+			_TopoMT_backwardRange(self, i, st, Std_bmin(layer->num_values, st + chunk));
+		}
+		_TopoMT_barrier(self, i_thread, sense, Trace_BACKWARD, i, time);
+		c ^= 1;
+	}
+
+	// serial work at the end was done by caller, workers wait in next start barrier.
+	// With trace, last wait events are written before caller returns
+	if (trace)
+		StdBarrier_wait(&self->barrier, sense);
+}
+
+// every thread(caller is #0) executes its part of job range
+void _TopoMT_runJob(TopoMT *self, const int i_thread, int *sense)
+{
+	const int st = (long long)self->job_n * i_thread / self->num_threads;
+	const int en = (long long)self->job_n * (i_thread + 1) / self->num_threads;
+	if (st < en)
+		self->job_func(self->job_prm, st, en);
+	StdBarrier_wait(&self->barrier, sense);
+}
+
 StdThread_FUNC(TopoThread_loop, arg)
 {
 	TopoThread *self = arg;
-	while (self->thread.run)
+	__atomic_store_n(&self->tid, Std_threadId(), __ATOMIC_RELEASE);
+
+	if (self->parent->sched == TopoMT_SCHED_BARRIER)
 	{
-		const int NTHREADS = self->parent->num_threads;
+		while (1)
+		{
+			StdBarrier_wait(&self->parent->barrier, &self->sense); // waits for TopoMT_run()
+			if (self->parent->exit)
+				break;
+			if (self->parent->job_func)
+				_TopoMT_runJob(self->parent, self->i_thread, &self->sense);
+			else
+				_TopoMT_runShared(self->parent, self->i_thread, &self->sense);
+		}
+		return 0;
+	}
 
+	while (self->thread.run)
+	{
+		Trace *trace = self->parent->trace;
+		const double time_wait = trace ? Os_timeMono() : 0;
 		if (OsSemaphore_wait(&self->semaphore_new_work)) // waits for fork
 		{
+			const int NTHREADS = self->num_split; // set with work
+			const double time = trace ? Os_timeMono() : 0;
+			if (trace)
+				Trace_add(trace, self->i_thread, Trace_WAIT, Std_bmax(self->forward_layer, self->backward_layer), time_wait, time);
+
 			if (self->forward_layer >= 0)
 			{
 				TopoLayer *layer = &self->parent->topo->layers[self->forward_layer];
@@ -82,6 +408,8 @@ StdThread_FUNC(TopoThread_loop, arg)
 				for (int i = st; i < en; i++)
 					Value_forward(layer->values[i]);
 
+				if (trace)
+					Trace_add(trace, self->i_thread, Trace_FORWARD, self->forward_layer, time, Os_timeMono());
 				self->forward_layer = -1;
 				OsSemaphore_trigger(&self->semaphore_work_done); // work is done
 			}
@@ -91,9 +419,10 @@ StdThread_FUNC(TopoThread_loop, arg)
 				const int step = layer->num_values / NTHREADS + 1;
 				const int st = step * self->i_thread;
 				const int en = Std_bmin(layer->num_values, step * (self->i_thread + 1));
-				for (int i = st; i < en; i++)
-					Value_backward(layer->values[i]);
+				_TopoMT_backwardRange(self->parent, self->backward_layer, st, en);
 
+				if (trace)
+					Trace_add(trace, self->i_thread, Trace_BACKWARD, self->backward_layer, time, Os_timeMono());
 				self->backward_layer = -1;
 				OsSemaphore_trigger(&self->semaphore_work_done); // work is done
 			}
@@ -102,21 +431,87 @@ StdThread_FUNC(TopoThread_loop, arg)
 	return 0;
 }
 
-TopoMT *TopoMT_new(int num_threads)
+TopoMT *TopoMT_newSched(int num_threads, TopoMT_SCHED sched)
 {
 	TopoMT *self = malloc(sizeof(TopoMT));
+	self->topo = 0;
 	self->num_threads = (num_threads <= 0) ? Std_numberOfThreads() : num_threads;
+	self->sched = sched;
+	self->backward = TopoMT_BACKWARD_GATHER;
+
+	StdBarrier_init(&self->barrier, self->num_threads);
+	self->sense = 0;
+	self->exit = 0;
+	self->cursor[0] = self->cursor[1] = 0;
+	self->phases = 0;
+	self->trace = 0;
+	self->pin = 0;
+	self->sync_ns = 0;
+
+	self->job_func = 0;
+	self->job_prm = 0;
+	self->job_n = 0;
 
 	self->threads = malloc(self->num_threads * sizeof(TopoThread));
 	for (int i = 0; i < self->num_threads; i++)
-		self->threads[i] = TopoThread_new(self, i);
+		self->threads[i] = (sched == TopoMT_SCHED_BARRIER && i == 0) ? 0 : TopoThread_new(self, i); // caller works as thread #0
+
+	TopoCost_get(); // calibrates op costs once per process
+	_TopoMT_measureSync(self);
 	return self;
 }
 
+void TopoMT_setBackward(TopoMT *self, TopoMT_BACKWARD backward)
+{
+	self->backward = backward;
+}
+
+// records work and waits of every thread into 'trace'(needs num_threads threads), 0 turns it off
+void TopoMT_setTrace(TopoMT *self, Trace *trace)
+{
+	self->trace = trace;
+}
+
+// pins thread #i to i-th CPU of process(0 = unpins). Thread stays on one core, so its caches and memory it touched first(NUMA node) stay near.
+// TopoMT_SCHED_BARRIER pins also calling thread, because it works as thread #0
+void TopoMT_setPinning(TopoMT *self, const char pin)
+{
+	self->pin = pin;
+	for (int i = 0; i < self->num_threads; i++)
+	{
+		const int cpu = pin ? Std_cpuOfIndex(i) : -1;
+		if (!self->threads[i])
+		{
+			Std_pinThread(0, cpu);
+			continue;
+		}
+
+		while (self->threads[i]->thread.thread && !__atomic_load_n(&self->threads[i]->tid, __ATOMIC_ACQUIRE))
+			Std_yield(); // thread is starting
+		if (self->threads[i]->tid)
+			Std_pinThread(self->threads[i]->tid, cpu);
+	}
+}
+
+TopoMT *TopoMT_new(int num_threads)
+{
+	return TopoMT_newSched(num_threads, TopoMT_SCHED_BARRIER);
+}
+
 void TopoMT_delete(TopoMT *self)
 {
+	if (self->pin && self->sched == TopoMT_SCHED_BARRIER)
+		Std_pinThread(0, -1); // caller was thread #0
+
+	if (self->sched == TopoMT_SCHED_BARRIER)
+	{
+		self->exit = 1;
+		StdBarrier_wait(&self->barrier, &self->sense); // releases workers
+	}
+
 	for (int i = 0; i < self->num_threads; i++)
-		TopoThread_delete(self->threads[i]);
+		if (self->threads[i])
+			TopoThread_delete(self->threads[i]);
 	memset(self->threads, 0, self->num_threads * sizeof(TopoThread));
 	free(self->threads);
 
@@ -124,43 +519,157 @@ void TopoMT_delete(TopoMT *self)
 	free(self);
 }
 
-void TopoMT_run(TopoMT *self, Topo *topo)
+// TopoMT_SCHED_SEMAPHORE: sends layer to first 'num_split' threads and waits until it's done
+void _TopoMT_dispatch(TopoMT *self, const int i_layer, const char backward, const int num_split)
+{
+	for (int t = 0; t < num_split; t++)
+	{
+		self->threads[t]->num_split = num_split;
+		if (backward)
+			self->threads[t]->backward_layer = i_layer;
+		else
+			self->threads[t]->forward_layer = i_layer;
+		OsSemaphore_trigger(&self->threads[t]->semaphore_new_work);
+	}
+
+	for (int t = 0; t < num_split; t++)
+		OsSemaphore_wait(&self->threads[t]->semaphore_work_done);
+}
+
+// runs 'phases'(TopoMT_PHASE mask) of topo
+void TopoMT_runPhases(TopoMT *self, Topo *topo, const int phases)
 {
 	if (topo->num_layers == 0)
 		return;
 
+	if (!TopoMT_isPlanned(self, topo))
+		TopoMT_plan(self, topo);
+
+	// nothing is worth waking threads, runs like Topo_run()
+	const char par_fwd = (phases & TopoMT_PHASE_FORWARD) && topo->plan_last_fwd >= 0;
+	const char par_bwd = (phases & TopoMT_PHASE_BACKWARD) && topo->plan_first_bwd >= 0;
+	if (!par_fwd && !par_bwd && !self->trace)
+	{
+		if (phases & TopoMT_PHASE_FORWARD)
+			Topo_forward(topo);
+		if (phases & TopoMT_PHASE_RESET)
+			Topo_resetGrads(topo);
+		else if (phases & TopoMT_PHASE_RESET_INNER)
+			Topo_resetInnerGrads(topo);
+		if (phases & TopoMT_PHASE_BACKWARD)
+			Topo_backprop(topo);
+		return;
+	}
+
 	self->topo = topo;
+	if ((phases & TopoMT_PHASE_BACKWARD) && self->backward == TopoMT_BACKWARD_GATHER)
+		Topo_buildUsers(topo);
+
+	if (self->sched == TopoMT_SCHED_BARRIER)
+	{
+		self->phases = phases;
+		self->cursor[0] = 0;
+		StdBarrier_wait(&self->barrier, &self->sense); // starts workers
+		_TopoMT_runShared(self, 0, &self->sense);
+		return;
+	}
 
 	// forward
-	for (int i = 0; i < topo->num_layers; i++)
+	for (int i = 0; i < topo->num_layers && (phases & TopoMT_PHASE_FORWARD); i++)
 	{
-		// sends work
-		for (int t = 0; t < self->num_threads; t++)
+		TopoLayer *layer = &topo->layers[i];
+		if (layer->fwd_threads)
+			_TopoMT_dispatch(self, i, 0, layer->fwd_threads);
+		else
 		{
-			self->threads[t]->forward_layer = i;
-			OsSemaphore_trigger(&self->threads[t]->semaphore_new_work);
+			for (int ii = 0; ii < layer->num_values; ii++)
+				Value_forward(layer->values[ii]);
 		}
-
-		// waits until it's done
-		for (int t = 0; t < self->num_threads; t++)
-			OsSemaphore_wait(&self->threads[t]->semaphore_work_done);
 	}
 
 	// resets grads
-	Topo_resetGrads(topo);
+	if (phases & TopoMT_PHASE_RESET)
+		Topo_resetGrads(topo);
+	else if (phases & TopoMT_PHASE_RESET_INNER)
+		Topo_resetInnerGrads(topo);
 
 	// backward
-	for (int i = topo->num_layers - 1; i >= 0; i--)
+	for (int i = topo->num_layers - 1; i >= 0 && (phases & TopoMT_PHASE_BACKWARD); i--)
 	{
-		// sends work
-		for (int t = 0; t < self->num_threads; t++)
+		TopoLayer *layer = &topo->layers[i];
+		if (layer->bwd_threads)
+			_TopoMT_dispatch(self, i, 1, layer->bwd_threads);
+		else
+			_TopoMT_backwardRange(self, i, 0, layer->num_values);
+	}
+}
+
+void TopoMT_forward(TopoMT *self, Topo *topo)
+{
+	TopoMT_runPhases(self, topo, TopoMT_PHASE_FORWARD);
+}
+
+// resets grads and propagates them from last layer
+void TopoMT_backward(TopoMT *self, Topo *topo)
+{
+	TopoMT_runPhases(self, topo, TopoMT_PHASE_RESET | TopoMT_PHASE_BACKWARD);
+}
+
+void TopoMT_run(TopoMT *self, Topo *topo)
+{
+	TopoMT_runPhases(self, topo, TopoMT_PHASE_FORWARD | TopoMT_PHASE_RESET | TopoMT_PHASE_BACKWARD);
+}
+
+// splits range <0, n) between all threads and waits until it's done. func() must not write same memory for different ranges
+void TopoMT_parallelFor(TopoMT *self, void (*func)(void *prm, int st, int en), void *prm, const int n)
+{
+	if (self->sched != TopoMT_SCHED_BARRIER || self->num_threads == 1)
+	{
+		if (n > 0)
+			func(prm, 0, n); // semaphore workers only know layers
+		return;
+	}
+
+	self->job_func = func;
+	self->job_prm = prm;
+	self->job_n = n;
+	StdBarrier_wait(&self->barrier, &self->sense); // starts workers
+	_TopoMT_runJob(self, 0, &self->sense);
+	self->job_func = 0;
+}
+
+void _TopoMT_nop(void *prm, int st, int en)
+{
+}
+
+// measures sync between all threads: barrier or semaphore round trip
+void _TopoMT_measureSync(TopoMT *self)
+{
+	const int N = 64;
+	self->sync_ns = 0;
+	if (self->num_threads == 1 && self->sched == TopoMT_SCHED_BARRIER)
+		return; // caller only
+
+	Value v;
+	_Value_init(&v, 0, Value_OP_EMPTY);
+	Topo *topo = Topo_new(&v);
+	self->topo = topo;
+
+	double best = 1e30;
+	for (int r = 0; r < 3; r++)
+	{
+		const double st = Os_timeMono();
+		for (int i = 0; i < N; i++)
 		{
-			self->threads[t]->backward_layer = i;
-			OsSemaphore_trigger(&self->threads[t]->semaphore_new_work);
+			if (self->sched == TopoMT_SCHED_BARRIER)
+				TopoMT_parallelFor(self, &_TopoMT_nop, 0, 0); // start + end barrier
+			else
+				_TopoMT_dispatch(self, 0, 0, self->num_threads);
 		}
-
-		// waits until it's done
-		for (int t = 0; t < self->num_threads; t++)
-			OsSemaphore_wait(&self->threads[t]->semaphore_work_done);
+		best = fmin(best, Os_timeMono() - st);
 	}
+	self->sync_ns = best * 1e9 / N / (self->sched == TopoMT_SCHED_BARRIER ? 2 : 1);
+
+	self->topo = 0;
+	Topo_delete(topo);
 }
@@ -0,0 +1,191 @@
+/*
+Copyright 2022 Milan Suk
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Opt-in execution trace. Every thread writes only its own event buffer, so recording doesn't need locks.
+// Output is Chrome/Perfetto JSON(chrome://tracing, ui.perfetto.dev) and summary table.
+
+typedef enum
+{
+	Trace_FORWARD,
+	Trace_BACKWARD,
+	Trace_RESET, // grads reset
+	Trace_WAIT,	 // barrier or semaphore wait
+} Trace_KIND;
+
+const char *Trace_NAMES[] = {"forward", "backward", "reset", "wait"};
+
+typedef struct TraceEvent_s
+{
+	double st, en;
+	int layer;
+	unsigned char kind;
+} TraceEvent;
+
+typedef struct TraceThread_s
+{
+	TraceEvent *events;
+	int num_events;
+	int num_dropped; // buffer was full
+} TraceThread;
+
+typedef struct Trace_s
+{
+	TraceThread *threads;
+	int num_threads;
+	int max_events; // per thread
+	double origin;	// time of Trace_reset()
+} Trace;
+
+Trace *Trace_new(const int num_threads, const int max_events)
+{
+	Trace *self = malloc(sizeof(Trace));
+	self->num_threads = num_threads;
+	self->max_events = max_events;
+	self->threads = malloc(num_threads * sizeof(TraceThread));
+	for (int i = 0; i < num_threads; i++)
+	{
+		self->threads[i].events = malloc(Std_bmax(1, max_events) * sizeof(TraceEvent));
+		self->threads[i].num_events = 0;
+		self->threads[i].num_dropped = 0;
+	}
+	self->origin = Os_timeMono();
+	return self;
+}
+
+void Trace_delete(Trace *self)
+{
+	for (int i = 0; i < self->num_threads; i++)
+		free(self->threads[i].events);
+	memset(self->threads, 0, self->num_threads * sizeof(TraceThread));
+	free(self->threads);
+
+	memset(self, 0, sizeof(Trace));
+	free(self);
+}
+
+void Trace_reset(Trace *self)
+{
+	for (int i = 0; i < self->num_threads; i++)
+	{
+		self->threads[i].num_events = 0;
+		self->threads[i].num_dropped = 0;
+	}
+	self->origin = Os_timeMono();
+}
+
+void Trace_add(Trace *self, const int i_thread, const Trace_KIND kind, const int layer, const double st, const double en)
+{
+	TraceThread *t = &self->threads[i_thread];
+	if (t->num_events >= self->max_events)
+	{
+		t->num_dropped++;
+		return;
+	}
+
+	TraceEvent *e = &t->events[t->num_events++];
+	e->st = st;
+	e->en = en;
+	e->layer = layer;
+	e->kind = kind;
+}
+
+char Trace_writeChrome(Trace *self, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f)
+		return 0;
+
+	fprintf(f, "{\"traceEvents\":[\n");
+	char first = 1;
+	for (int t = 0; t < self->num_threads; t++)
+	{
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"TopoThread %d\"}}", first ? "" : ",\n", t, t);
+		first = 0;
+
+		TraceThread *th = &self->threads[t];
+		for (int i = 0; i < th->num_events; i++)
+		{
+			const TraceEvent *e = &th->events[i];
+			fprintf(f, ",\n{\"name\":\"%s L%d\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d,\"args\":{\"layer\":%d}}",
+					Trace_NAMES[e->kind], e->layer, Trace_NAMES[e->kind], (e->st - self->origin) * 1000000, (e->en - e->st) * 1000000, t, e->layer);
+		}
+	}
+	fprintf(f, "\n]}\n");
+
+	return fclose(f) == 0;
+}
+
+// utilization per thread and work/imbalance per layer
+void Trace_printSummary(Trace *self, FILE *f)
+{
+	int num_layers = 0;
+	for (int t = 0; t < self->num_threads; t++)
+		for (int i = 0; i < self->threads[t].num_events; i++)
+			num_layers = Std_bmax(num_layers, self->threads[t].events[i].layer + 1);
+
+	// [thread][kind]
+	double *threads = malloc(self->num_threads * 4 * sizeof(double));
+	memset(threads, 0, self->num_threads * 4 * sizeof(double));
+
+	// [layer][kind][thread]
+	const size_t n_layers = (size_t)Std_bmax(1, num_layers) * 2 * self->num_threads;
+	double *layers = malloc(n_layers * sizeof(double));
+	memset(layers, 0, n_layers * sizeof(double));
+
+	for (int t = 0; t < self->num_threads; t++)
+	{
+		TraceThread *th = &self->threads[t];
+		for (int i = 0; i < th->num_events; i++)
+		{
+			const TraceEvent *e = &th->events[i];
+			const double dt = e->en - e->st;
+			threads[t * 4 + e->kind] += dt;
+			if (e->kind == Trace_FORWARD || e->kind == Trace_BACKWARD)
+				layers[((size_t)e->layer * 2 + e->kind) * self->num_threads + t] += dt;
+		}
+	}
+
+	fprintf(f, "thread | forward ms | backward ms | reset ms | wait ms | utilization | dropped\n");
+	for (int t = 0; t < self->num_threads; t++)
+	{
+		const double *k = &threads[t * 4];
+		const double busy = k[Trace_FORWARD] + k[Trace_BACKWARD] + k[Trace_RESET];
+		fprintf(f, "%6d | %10.3f | %11.3f | %8.3f | %7.3f | %10.1f%% | %d\n", t,
+				k[Trace_FORWARD] * 1000, k[Trace_BACKWARD] * 1000, k[Trace_RESET] * 1000, k[Trace_WAIT] * 1000,
+				(busy + k[Trace_WAIT]) > 0 ? busy / (busy + k[Trace_WAIT]) * 100 : 0, self->threads[t].num_dropped);
+	}
+
+	// imbalance = slowest thread / average thread, 1.0 is perfect split
+	fprintf(f, "layer | forward ms | fwd imbalance | backward ms | bwd imbalance\n");
+	for (int l = 0; l < num_layers; l++)
+	{
+		double sum[2] = {0, 0}, max[2] = {0, 0};
+		for (int k = 0; k < 2; k++)
+			for (int t = 0; t < self->num_threads; t++)
+			{
+				const double v = layers[((size_t)l * 2 + k) * self->num_threads + t];
+				sum[k] += v;
+				max[k] = fmax(max[k], v);
+			}
+
+		fprintf(f, "%5d | %10.3f | %13.2f | %11.3f | %13.2f\n", l,
+				sum[0] * 1000, sum[0] > 0 ? max[0] / (sum[0] / self->num_threads) : 0,
+				sum[1] * 1000, sum[1] > 0 ? max[1] / (sum[1] / self->num_threads) : 0);
+	}
+
+	free(threads);
+	free(layers);
+}
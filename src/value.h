@@ -25,6 +25,8 @@ typedef enum
 	Value_OP_NEG,
 	Value_OP_TANH,
 	Value_OP_RELU,
+	Value_OP_DOT, // n-ary
+	Value_OP_SUM, // n-ary
 } Value_OP;
 
 typedef struct Value_s
@@ -32,9 +34,17 @@ typedef struct Value_s
 	double data;
 	double grad;
 
-	struct Value_s *prevs[2];
+	union
+	{
+		struct Value_s *prevs[2];
+		struct
+		{
+			struct Value_s **args; // DOT: a[0..num_args) + b[0..num_args), SUM: [0..num_args)
+			unsigned int num_args;
+		};
+	};
 
-	unsigned char op : 7, visited : 1;
+	unsigned char op : 6, visited : 1, literal : 1; // literal = leaf which never changes, optimizer can fold and share it
 	unsigned int layer; // TODO: too much space - get rid of it
 } Value;
 
@@ -47,6 +57,8 @@ Value *_Value_init(Value *self, const double data, const Value_OP op)
 
 	self->op = op;
 	self->visited = 0;
+	self->literal = 0;
+	self->layer = 0; // memory can be reused(ValueAllocator_release())
 	return self;
 }
 
@@ -60,27 +72,77 @@ void Value_setPre2(Value *self, Value *a, Value *b)
 	Value_setPre(self, 1, b);
 }
 
-void _Value_resetVisited(Value *v)
+// returns all operands, some of them can be 0
+Value **Value_getPrevs(Value *self, int *num)
 {
-	if (v)
+	switch (self->op)
 	{
-		_Value_resetVisited(v->prevs[0]);
-		_Value_resetVisited(v->prevs[1]);
-		v->visited = 0;
-		v->layer = 1000000000;
+	case Value_OP_DOT:
+		*num = 2 * self->num_args;
+		return self->args;
+	case Value_OP_SUM:
+		*num = self->num_args;
+		return self->args;
+	default:
+		*num = 2;
+		return self->prevs;
 	}
 }
-int _Value_updateDepth(Value *v)
+
+// 4 independent sums break the dependency chain of additions, so loads and multiplies can be vectorized
+double _Value_dot(Value **a, Value **b, const unsigned int n)
 {
-	int depth = 0;
-	if (v)
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	unsigned int i = 0;
+	for (; i + 4 <= n; i += 4)
 	{
-		depth = Std_bmax(_Value_updateDepth(v->prevs[0]), _Value_updateDepth(v->prevs[1]));
-		v->layer = Std_bmin(v->layer, depth);
-		depth++;
+		s0 += a[i + 0]->data * b[i + 0]->data;
+		s1 += a[i + 1]->data * b[i + 1]->data;
+		s2 += a[i + 2]->data * b[i + 2]->data;
+		s3 += a[i + 3]->data * b[i + 3]->data;
 	}
-
-	return depth;
+	for (; i < n; i++)
+		s0 += a[i]->data * b[i]->data;
+	return (s0 + s1) + (s2 + s3);
+}
+// all 8 products of block are computed before any grad is written, so loads and multiplies can be vectorized.
+// Grads are added one by one in operand order, same Value can be in 'a' and 'b'(x * x)
+void _Value_dotGrad(Value **a, Value **b, const unsigned int n, const double g)
+{
+	unsigned int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		const double ga0 = b[i + 0]->data * g, ga1 = b[i + 1]->data * g, ga2 = b[i + 2]->data * g, ga3 = b[i + 3]->data * g;
+		const double gb0 = a[i + 0]->data * g, gb1 = a[i + 1]->data * g, gb2 = a[i + 2]->data * g, gb3 = a[i + 3]->data * g;
+		a[i + 0]->grad += ga0;
+		b[i + 0]->grad += gb0;
+		a[i + 1]->grad += ga1;
+		b[i + 1]->grad += gb1;
+		a[i + 2]->grad += ga2;
+		b[i + 2]->grad += gb2;
+		a[i + 3]->grad += ga3;
+		b[i + 3]->grad += gb3;
+	}
+	for (; i < n; i++)
+	{
+		a[i]->grad += b[i]->data * g;
+		b[i]->grad += a[i]->data * g;
+	}
+}
+double _Value_sum(Value **a, const unsigned int n)
+{
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	unsigned int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		s0 += a[i + 0]->data;
+		s1 += a[i + 1]->data;
+		s2 += a[i + 2]->data;
+		s3 += a[i + 3]->data;
+	}
+	for (; i < n; i++)
+		s0 += a[i]->data;
+	return (s0 + s1) + (s2 + s3);
 }
 
 void Value_forward(Value *self)
@@ -116,6 +178,12 @@ void Value_forward(Value *self)
 	case Value_OP_RELU:
 		self->data = (self->prevs[0]->data < 0) ? 0.0 : self->prevs[0]->data;
 		break;
+	case Value_OP_DOT:
+		self->data = _Value_dot(self->args, self->args + self->num_args, self->num_args);
+		break;
+	case Value_OP_SUM:
+		self->data = _Value_sum(self->args, self->num_args);
+		break;
 	}
 }
 
@@ -156,61 +224,280 @@ void Value_backward(Value *self)
 	case Value_OP_RELU:
 		self->prevs[0]->grad += (self->data > 0.0) * self->grad;
 		break;
+	case Value_OP_DOT:
+		_Value_dotGrad(self->args, self->args + self->num_args, self->num_args, self->grad);
+		break;
+	case Value_OP_SUM:
+		for (unsigned int i = 0; i < self->num_args; i++)
+			self->args[i]->grad += self->grad;
+		break;
+	}
+}
+
+// derivative of self by operand Value_getPrevs()[slot]
+double Value_partial(const Value *self, const int slot)
+{
+	switch (self->op)
+	{
+	case Value_OP_EMPTY:
+		return 0;
+	case Value_OP_ADD:
+		return 1;
+	case Value_OP_SUB:
+		return slot ? -1 : 1;
+	case Value_OP_MUL:
+		return self->prevs[!slot]->data;
+	case Value_OP_DIV:
+	{
+		const double b = self->prevs[1]->data;
+		return slot ? -(self->prevs[0]->data / (b * b)) : (1.0 / b);
 	}
+	case Value_OP_POW_CONST:
+		return slot ? 0 : self->prevs[1]->data * pow(self->prevs[0]->data, self->prevs[1]->data - 1);
+	case Value_OP_NEG:
+		return -1;
+	case Value_OP_TANH:
+		return 1 - (self->data * self->data);
+	case Value_OP_RELU:
+		return self->data > 0.0;
+	case Value_OP_DOT:
+		return (slot < (int)self->num_args) ? self->args[slot + self->num_args]->data : self->args[slot - self->num_args]->data;
+	case Value_OP_SUM:
+		return 1;
+	}
+	return 0;
 }
 
+// memory block of ValueAllocator, malloc() or mmap() with huge pages
+typedef struct ValueBlock_s
+{
+	void *ptr;
+	size_t bytes;
+	char mapped;
+} ValueBlock;
+
+// position in arena, see ValueAllocator_mark()
+typedef struct ValueAllocatorMark_s
+{
+	int block;
+	int pos;
+	int arg_block;
+	int arg_pos;
+	int num_values;
+} ValueAllocatorMark;
+
+// Arena of Values. Released/reset blocks stay allocated and are reused, so rebuilding graphs doesn't call malloc()
 typedef struct ValueAllocator_s
 {
-	Value **blocks; // block = 65536x Value
-	int num_blocks;
+	ValueBlock *blocks; // block = block_size x Value(more when huge page rounds it up)
+	int num_blocks;		// allocated blocks, some of them can be unused after release
+	int block_size;
+	char huge_pages;
+
+	ValueAllocatorMark cur; // current block and position in it
 
-	int num_values; // total # of values
+	ValueBlock *arg_blocks; // block = block_size x Value*(or more for big n-ary node)
+	int num_arg_blocks;
+
+	struct ValueAllocator_s **children; // per-thread arenas, Values live until parent is reset/deleted
+	int num_children;
 } ValueAllocator;
 
-ValueAllocator *ValueAllocator_new(void)
+#define ValueAllocator_HUGE_PAGE (2 * 1024 * 1024)
+
+void _ValueBlock_alloc(ValueBlock *self, size_t bytes, const char huge_pages)
+{
+	self->mapped = 0;
+	if (huge_pages)
+	{
+		bytes = (bytes + ValueAllocator_HUGE_PAGE - 1) / ValueAllocator_HUGE_PAGE * ValueAllocator_HUGE_PAGE;
+
+		// reserved huge pages, then transparent huge pages
+		void *ptr = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr == MAP_FAILED)
+		{
+			ptr = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ptr != MAP_FAILED)
+				madvise(ptr, bytes, MADV_HUGEPAGE);
+		}
+
+		if (ptr != MAP_FAILED)
+		{
+			self->ptr = ptr; // already zeroed
+			self->bytes = bytes;
+			self->mapped = 1;
+			return;
+		}
+	}
+
+	self->ptr = malloc(bytes);
+	self->bytes = bytes;
+	memset(self->ptr, 0, bytes);
+}
+
+void _ValueBlock_free(ValueBlock *self)
+{
+	if (self->mapped)
+		munmap(self->ptr, self->bytes);
+	else
+	{
+		memset(self->ptr, 0, self->bytes);
+		free(self->ptr);
+	}
+	memset(self, 0, sizeof(ValueBlock));
+}
+
+// 'block_size' is # of Values per block, 'huge_pages' backs blocks with 2MB pages(falls back to normal pages)
+ValueAllocator *ValueAllocator_newConfig(const int block_size, const char huge_pages)
 {
 	ValueAllocator *self = malloc(sizeof(ValueAllocator));
 	self->blocks = 0;
 	self->num_blocks = 0;
-	self->num_values = 0;
+	self->block_size = Std_bmax(1, block_size);
+	self->huge_pages = huge_pages;
+	memset(&self->cur, 0, sizeof(ValueAllocatorMark));
+	self->cur.block = -1;
+	self->cur.arg_block = -1;
+	self->arg_blocks = 0;
+	self->num_arg_blocks = 0;
+	self->children = 0;
+	self->num_children = 0;
 	return self;
 }
+
+ValueAllocator *ValueAllocator_new(void)
+{
+	return ValueAllocator_newConfig(65536, 0);
+}
+
 void ValueAllocator_delete(ValueAllocator *self)
 {
+	for (int i = 0; i < self->num_children; i++)
+		ValueAllocator_delete(self->children[i]);
+	free(self->children);
+
 	for (int i = 0; i < self->num_blocks; i++)
-	{
-		memset(self->blocks[i], 0, sizeof(Value) * 65536);
-		free(self->blocks[i]);
-	}
-	memset(self->blocks, 0, self->num_blocks * sizeof(Value *));
+		_ValueBlock_free(&self->blocks[i]);
 	free(self->blocks);
 
+	for (int i = 0; i < self->num_arg_blocks; i++)
+		_ValueBlock_free(&self->arg_blocks[i]);
+	free(self->arg_blocks);
+
 	memset(self, 0, sizeof(ValueAllocator));
 	free(self);
 }
+
 Value *ValueAllocator_alloc(ValueAllocator *self)
 {
-	if (self->num_values % 65536 == 0)
+	ValueAllocatorMark *cur = &self->cur;
+	// capacity comes from bytes, huge page block holds more than block_size Values
+	if (cur->block < 0 || (size_t)(cur->pos + 1) * sizeof(Value) > self->blocks[cur->block].bytes)
 	{
-		// resizes base
-		self->num_blocks++;
-		self->blocks = realloc(self->blocks, self->num_blocks * sizeof(Value *));
+		cur->block++;
+		cur->pos = 0;
 
-		// adds block
-		self->blocks[self->num_blocks - 1] = malloc(sizeof(Value) * 65536);
-		memset(self->blocks[self->num_blocks - 1], 0, sizeof(Value) * 65536);
+		// adds block, released ones are reused
+		if (cur->block == self->num_blocks)
+		{
+			self->num_blocks++;
+			self->blocks = realloc(self->blocks, self->num_blocks * sizeof(ValueBlock));
+			_ValueBlock_alloc(&self->blocks[cur->block], (size_t)self->block_size * sizeof(Value), self->huge_pages);
+		}
 	}
 
-	Value *ret = &self->blocks[self->num_blocks - 1][self->num_values % 65536];
-	self->num_values++;
+	Value *ret = &((Value *)self->blocks[cur->block].ptr)[cur->pos++];
+	cur->num_values++;
 	return ret;
 }
 
+// allocates array of operands for n-ary node
+Value **ValueAllocator_allocArgs(ValueAllocator *self, const int n)
+{
+	ValueAllocatorMark *cur = &self->cur;
+	while (cur->arg_block < 0 || (size_t)(cur->arg_pos + n) * sizeof(Value *) > self->arg_blocks[cur->arg_block].bytes)
+	{
+		cur->arg_block++;
+		cur->arg_pos = 0;
+
+		const size_t bytes = (size_t)Std_bmax(n, self->block_size) * sizeof(Value *);
+		if (cur->arg_block == self->num_arg_blocks)
+		{
+			// adds block
+			self->num_arg_blocks++;
+			self->arg_blocks = realloc(self->arg_blocks, self->num_arg_blocks * sizeof(ValueBlock));
+			_ValueBlock_alloc(&self->arg_blocks[cur->arg_block], bytes, self->huge_pages);
+		}
+		else if (self->arg_blocks[cur->arg_block].bytes < bytes)
+		{
+			// released block is too small for this node
+			_ValueBlock_free(&self->arg_blocks[cur->arg_block]);
+			_ValueBlock_alloc(&self->arg_blocks[cur->arg_block], bytes, self->huge_pages);
+		}
+	}
+
+	Value **ret = &((Value **)self->arg_blocks[cur->arg_block].ptr)[cur->arg_pos];
+	cur->arg_pos += n;
+	return ret;
+}
+
+// returns current position. Values allocated after it are freed by ValueAllocator_release()
+ValueAllocatorMark ValueAllocator_mark(const ValueAllocator *self)
+{
+	return self->cur;
+}
+
+// frees Values(and n-ary operands) allocated after 'mark'. Their memory is reused by next allocations
+void ValueAllocator_release(ValueAllocator *self, const ValueAllocatorMark mark)
+{
+	self->cur = mark;
+}
+
+// frees all Values(including children's), blocks are kept for reuse
+void ValueAllocator_reset(ValueAllocator *self)
+{
+	memset(&self->cur, 0, sizeof(ValueAllocatorMark));
+	self->cur.block = -1;
+	self->cur.arg_block = -1;
+
+	for (int i = 0; i < self->num_children; i++)
+		ValueAllocator_reset(self->children[i]);
+}
+
+// creates 'num_children' arenas with same config, every thread gets own one, so they can build graphs without locking.
+// Parent owns children, mark/release of parent doesn't rewind them(use their own mark/release)
+void ValueAllocator_setChildren(ValueAllocator *self, const int num_children)
+{
+	for (int i = num_children; i < self->num_children; i++)
+		ValueAllocator_delete(self->children[i]);
+
+	self->children = realloc(self->children, num_children * sizeof(ValueAllocator *));
+	for (int i = self->num_children; i < num_children; i++)
+		self->children[i] = ValueAllocator_newConfig(self->block_size, self->huge_pages);
+	self->num_children = num_children;
+}
+
+// # of Values in use(including children)
+int ValueAllocator_numValues(const ValueAllocator *self)
+{
+	int n = self->cur.num_values;
+	for (int i = 0; i < self->num_children; i++)
+		n += ValueAllocator_numValues(self->children[i]);
+	return n;
+}
+
 Value *VA_const(ValueAllocator *allocator, const double data)
 {
 	Value *self = _Value_init(ValueAllocator_alloc(allocator), data, Value_OP_EMPTY);
 	return self;
 }
+// constant which is never changed(unlike inputs created by VA_const()), Optimize_graph() folds and shares them
+Value *VA_literal(ValueAllocator *allocator, const double data)
+{
+	Value *self = _Value_init(ValueAllocator_alloc(allocator), data, Value_OP_EMPTY);
+	self->literal = 1;
+	return self;
+}
 Value *VA_add(ValueAllocator *allocator, Value *a, Value *b)
 {
 	Value *self = _Value_init(ValueAllocator_alloc(allocator), 0, Value_OP_ADD);
@@ -265,3 +552,24 @@ Value *VA_relu(ValueAllocator *allocator, Value *a)
 	Value_setPre(self, 0, a);
 	return self;
 }
+
+// a[0] * b[0] + a[1] * b[1] + ... + a[n-1] * b[n-1]
+Value *VA_dot(ValueAllocator *allocator, Value **a, Value **b, const int n)
+{
+	Value *self = _Value_init(ValueAllocator_alloc(allocator), 0, Value_OP_DOT);
+	self->args = ValueAllocator_allocArgs(allocator, 2 * n);
+	self->num_args = n;
+	memcpy(self->args, a, n * sizeof(Value *));
+	memcpy(self->args + n, b, n * sizeof(Value *));
+	return self;
+}
+
+// a[0] + a[1] + ... + a[n-1]
+Value *VA_sum(ValueAllocator *allocator, Value **a, const int n)
+{
+	Value *self = _Value_init(ValueAllocator_alloc(allocator), 0, Value_OP_SUM);
+	self->args = ValueAllocator_allocArgs(allocator, n);
+	self->num_args = n;
+	memcpy(self->args, a, n * sizeof(Value *));
+	return self;
+}